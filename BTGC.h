@@ -15,6 +15,23 @@
 #ifndef __BTGC_H__
 #define __BTGC_H__
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef __BTGC_Background__
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
 #ifndef __BTGC_ReportCollection__
 #define __BTGC_ReportCollection__
 #endif
@@ -27,6 +44,40 @@
 #define __BTGC_Free__ free
 #endif
 
+// Returns the memory behind an empty arena page to the OS, keeping the address
+// range, which may be touched again later. Define it to do nothing if
+// __BTGC_Malloc__ returns memory that mustn't be discarded this way.
+#ifndef __BTGC_ReleasePages__
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#ifdef __linux__
+#define __BTGC_ReleasePages__(addr, size) madvise(addr, size, MADV_DONTNEED)
+#else
+#define __BTGC_ReleasePages__(addr, size) madvise(addr, size, MADV_FREE)
+#endif
+#else
+#define __BTGC_ReleasePages__(addr, size) ((void)(addr), (void)(size))
+#endif
+#endif
+
+// Hints that memory will be read soon. Searches follow links all over the
+// heap, so they prefetch the ones they'll follow next.
+#ifndef __BTGC_Prefetch__
+#if defined(__GNUC__) || defined(__clang__)
+#define __BTGC_Prefetch__(addr) __builtin_prefetch(addr)
+#else
+#define __BTGC_Prefetch__(addr) ((void)(addr))
+#endif
+#endif
+
+// Defining __BTGC_Stats__ makes the GC count its work, for BTGC::stats().
+// Otherwise the counting compiles to nothing.
+#ifdef __BTGC_Stats__
+#define __BTGC_Stat__(statement) statement
+#else
+#define __BTGC_Stat__(statement)
+#endif
+
 namespace btgc {
 
 template <typename T>
@@ -44,62 +95,553 @@ class Array {
   size_t size() const { return n; }
   void del(size_t i) {
     --n;
-    a[i] = a[n];
+    a[i] = std::move(a[n]);
   }
   T pop() {
     --n;
-    return a[n];
+    return std::move(a[n]);
   }
   void clear() { n = 0; }
+  void truncate(size_t size) { n = size; }
+  void reserve(size_t capacity) {
+    if (capacity > m) grow(capacity);
+  }
   void add(T t) {
-    if (n >= m) {
-      m <<= 1;
-      T *b = new T[m];
-      for (size_t i = 0; i < n; ++i) {
-        b[i] = a[i];
-      }
-      delete[] a;
-      a = b;
+    if (n >= m) grow(m << 1);
+    a[n] = std::move(t);
+    ++n;
+  }
+
+ private:
+  void grow(size_t capacity) {
+    m = capacity;
+    T *b = new T[m];
+    for (size_t i = 0; i < n; ++i) {
+      b[i] = std::move(a[i]);
+    }
+    delete[] a;
+    a = b;
+  }
+};
+
+// Like Array, but stored in fixed size chunks, so growing it never copies the
+// elements, only the much smaller table of chunks. For arrays that grow with
+// the heap, where copying everything would be a long pause.
+template <typename T>
+class ChunkedArray {
+  static constexpr size_t kChunkShift = 12;
+  static constexpr size_t kChunkSize = 1 << kChunkShift;
+  Array<T *> chunks;
+  size_t n;
+
+ public:
+  ChunkedArray() : n(0) {}
+  ~ChunkedArray() {
+    for (size_t i = 0; i < chunks.size(); ++i) delete[] chunks[i];
+  }
+  ChunkedArray(const ChunkedArray<T> &box) = delete;
+  ChunkedArray<T> &operator=(const ChunkedArray<T> &box) = delete;
+  T &operator[](size_t i) {
+    return chunks[i >> kChunkShift][i & (kChunkSize - 1)];
+  }
+  size_t size() const { return n; }
+  T pop() {
+    --n;
+    return std::move((*this)[n]);
+  }
+  void reserve(size_t capacity) {
+    while (chunks.size() << kChunkShift < capacity) {
+      chunks.add(new T[kChunkSize]);
     }
-    a[n] = t;
+  }
+  void add(T t) {
+    if (n == chunks.size() << kChunkShift) chunks.add(new T[kChunkSize]);
+    (*this)[n] = std::move(t);
     ++n;
   }
 };
 
+// Segregated size-class allocator backing the GC. Memory is requested from
+// __BTGC_Malloc__ in chunks, which are carved into aligned pages. Each page
+// serves a single size class, and keeps its own free list, so allocation is a
+// free list pop or a pointer bump, and freeing is a free list push. Requests
+// that are too big for any size class go straight to __BTGC_Malloc__.
+//
+// Pages that become empty are noted as they're freed, and trim takes them out
+// of their size class, so any class can reuse them. Beyond the retained
+// pages, it returns them to the OS with __BTGC_ReleasePages__, a few at a
+// time, so the heap shrinks without a long stall.
+//
+// To compact the heap, beginEvacuation takes the pages that are at most half
+// full out of their size classes, so nothing more is allocated from them, and
+// the GC moves what it can out of them, until endEvacuation puts them back.
+class Arena {
+ public:
+  static constexpr size_t kPageSize = 1 << 16;
+  static constexpr size_t kPagesPerChunk = 16;
+  static constexpr size_t kGranule = 16;
+  static constexpr size_t kNumClasses = 63;
+  static constexpr uint8_t kLarge = kNumClasses;  // Fits in 6 bits.
+
+  static uint8_t sizeClass(size_t size) {
+    size_t c = (size + kGranule - 1) / kGranule;
+    return c <= kNumClasses ? (uint8_t)(c - 1) : kLarge;
+  }
+
+  // Size of the memory behind an allocation. Large allocations are prefixed
+  // by their size.
+  static size_t size(void *ptr, uint8_t c) {
+    if (c == kLarge) return *(size_t *)((char *)ptr - kGranule);
+    return (c + 1) * kGranule;
+  }
+
+ private:
+  struct Cell {
+    Cell *next;
+  };
+
+  struct Page {
+    Cell *free;       // Cells that have been released back to this page.
+    char *bump;       // Start of the never allocated cells.
+    char *end;        // End of the last cell that fits in the page.
+    Page *next;       // Next page in avail[sizeClass].
+    Page *prev;       // Previous page in avail[sizeClass].
+    size_t live;      // Number of allocated cells.
+    uint8_t sizeClass;
+    bool available;   // Whether the page is in avail[sizeClass].
+    bool emptied;     // Whether the page is in emptied.
+    bool evacuating;  // Whether the page is in sparsePages.
+  };
+
+  static constexpr size_t kPageHeader =
+      (sizeof(Page) + kGranule - 1) / kGranule * kGranule;
+
+  Page *avail[kNumClasses];  // Pages with at least one free cell, per class.
+  Array<Page *> freePages;      // Unused pages, still backed by memory.
+  Array<Page *> releasedPages;  // Unused pages returned to the OS.
+  Array<Page *> emptied;        // Pages that may have no live cells.
+  Array<Page *> sparsePages;    // Pages being evacuated by compaction.
+  Array<void *> chunks;
+  size_t retainedPages = kDefaultRetainedPages;
+
+  static Page *pageOf(void *ptr) {
+    return (Page *)((uintptr_t)ptr & ~(uintptr_t)(kPageSize - 1));
+  }
+
+  Page *newPage(uint8_t c) {
+    if (freePages.size() == 0 && releasedPages.size() == 0) {
+      // Over allocate by a page, so that the pages can be aligned.
+      void *chunk = __BTGC_Malloc__((kPagesPerChunk + 1) * kPageSize);
+      chunks.add(chunk);
+      uintptr_t first =
+          ((uintptr_t)chunk + kPageSize - 1) & ~(uintptr_t)(kPageSize - 1);
+      for (size_t i = kPagesPerChunk; i > 0; --i) {
+        freePages.add((Page *)(first + (i - 1) * kPageSize));
+      }
+    }
+    // Pages that are still backed by memory are reused first.
+    Page *page =
+        freePages.size() > 0 ? freePages.pop() : releasedPages.pop();
+    size_t cellSize = (c + 1) * kGranule;
+    page->free = nullptr;
+    page->bump = (char *)page + kPageHeader;
+    page->end = page->bump + (kPageSize - kPageHeader) / cellSize * cellSize;
+    page->next = nullptr;
+    page->prev = nullptr;
+    page->live = 0;
+    page->sizeClass = c;
+    page->available = true;
+    page->emptied = false;
+    page->evacuating = false;
+    avail[c] = page;
+    return page;
+  }
+
+  void push(Page *page) {
+    Page *&head = avail[page->sizeClass];
+    page->next = head;
+    page->prev = nullptr;
+    if (head != nullptr) head->prev = page;
+    head = page;
+    page->available = true;
+  }
+
+  void unlink(Page *page) {
+    if (page->prev != nullptr) {
+      page->prev->next = page->next;
+    } else {
+      avail[page->sizeClass] = page->next;
+    }
+    if (page->next != nullptr) page->next->prev = page->prev;
+    page->next = nullptr;
+    page->prev = nullptr;
+    page->available = false;
+  }
+
+ public:
+  Arena() {
+    for (size_t i = 0; i < kNumClasses; ++i) avail[i] = nullptr;
+  }
+
+  ~Arena() {
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      __BTGC_Free__(chunks[i]);
+    }
+  }
+
+  Arena(const Arena &arena) = delete;
+  Arena &operator=(const Arena &arena) = delete;
+
+  static constexpr size_t kDefaultRetainedPages = 64;
+
+  // Number of empty pages kept, rather than returned to the OS.
+  size_t getRetainedPages() const { return retainedPages; }
+  void setRetainedPages(size_t n) { retainedPages = n; }
+
+  // Bytes of pages that haven't been returned to the OS.
+  size_t residentBytes() const {
+    return (chunks.size() * kPagesPerChunk - releasedPages.size()) * kPageSize;
+  }
+
+  void *allocate(size_t size, uint8_t c) {
+    if (c == kLarge) {
+      char *large = (char *)__BTGC_Malloc__(size + kGranule);
+      *(size_t *)large = size;
+      return large + kGranule;
+    }
+    Page *page = avail[c];
+    if (page == nullptr) page = newPage(c);
+    void *ptr;
+    if (page->free != nullptr) {
+      ptr = page->free;
+      page->free = page->free->next;
+    } else {
+      ptr = page->bump;
+      page->bump += (c + 1) * kGranule;
+    }
+    ++page->live;
+    if (page->free == nullptr && page->bump == page->end) {
+      // Page is full.
+      unlink(page);
+    }
+    return ptr;
+  }
+
+  void release(void *ptr, uint8_t c) {
+    if (c == kLarge) {
+      __BTGC_Free__((char *)ptr - kGranule);
+      return;
+    }
+    Page *page = pageOf(ptr);
+    Cell *cell = (Cell *)ptr;
+    cell->next = page->free;
+    page->free = cell;
+    --page->live;
+    if (!page->available && !page->evacuating) push(page);
+    if (page->live == 0 && !page->emptied) {
+      page->emptied = true;
+      emptied.add(page);
+    }
+  }
+
+  // Takes the pages that are still empty out of their size classes, and
+  // returns up to maxPages of the unused pages beyond the retained ones to the
+  // OS. Returns the number of pages returned.
+  size_t trim(size_t maxPages) {
+    while (emptied.size() > 0) {
+      Page *page = emptied.pop();
+      page->emptied = false;
+      if (page->live > 0 || !page->available) continue;
+      unlink(page);
+      freePages.add(page);
+    }
+    size_t n = 0;
+    for (; n < maxPages && freePages.size() > retainedPages; ++n) {
+      Page *page = freePages.pop();
+      __BTGC_ReleasePages__((void *)page, kPageSize);
+      releasedPages.add(page);
+    }
+    return n;
+  }
+
+  // Takes the sparse pages out of their size classes, and returns how many
+  // there are. A class's only page is left alone, since moving its cells to a
+  // new page would gain nothing.
+  size_t beginEvacuation() {
+    trim(0);
+    for (size_t c = 0; c < kNumClasses; ++c) {
+      size_t capacity = (kPageSize - kPageHeader) / ((c + 1) * kGranule);
+      size_t first = sparsePages.size(), dense = 0;
+      for (Page *page = avail[c]; page != nullptr; page = page->next) {
+        if (page->live * 2 <= capacity) {
+          sparsePages.add(page);
+        } else {
+          ++dense;
+        }
+      }
+      if (sparsePages.size() == first + 1 && dense == 0) sparsePages.pop();
+    }
+    for (size_t i = 0; i < sparsePages.size(); ++i) {
+      unlink(sparsePages[i]);
+      sparsePages[i]->evacuating = true;
+    }
+    return sparsePages.size();
+  }
+
+  // Whether the cell is on a page that's being evacuated.
+  static bool evacuating(void *ptr, uint8_t c) {
+    return c != kLarge && pageOf(ptr)->evacuating;
+  }
+
+  // Puts the evacuated pages back, or with the unused pages if they're empty.
+  void endEvacuation() {
+    for (size_t i = 0; i < sparsePages.size(); ++i) {
+      Page *page = sparsePages[i];
+      page->evacuating = false;
+      if (page->live > 0) {
+        push(page);
+      } else {
+        freePages.add(page);
+      }
+    }
+    sparsePages.clear();
+  }
+};
+
+// Whether objects of type T contain no Ptrs, so they can't point to other
+// objects, or be part of a cycle. Trivially destructible types can't contain
+// Ptrs, so they're leaves by default. Specialize this for other types that
+// have no Ptrs, such as ones that own a std::string, to make them cheaper to
+// collect.
 template <class T>
-class Ptr;
+struct leaf : std::is_trivially_destructible<T> {};
+
+// Whether objects of type T can be moved by BTGC::compact, by copying their
+// bytes. Only leaves are moved, and only if nothing holds a raw pointer or
+// reference to them across the call, other than the GC's own Ptr, WeakPtr and
+// Local. Specialize this for such types, to let compaction pack them densely.
+template <class T>
+struct relocatable : std::false_type {};
+
+// A snapshot of what the GC has done since BTGC::init, or the last
+// BTGC::resetStats. Apart from the sizes of the heap, the counters are only
+// kept, and non-zero, if __BTGC_Stats__ is defined.
+struct Stats {
+  static constexpr size_t kSearchLengthBuckets = 32;
+
+  // Steps run in each mode, and steps that ran queued destructors.
+  size_t initializeSteps = 0;
+  size_t searchSteps = 0;
+  size_t proveSteps = 0;
+  size_t finalizeSteps = 0;
+  size_t destroySteps = 0;
+  size_t retireSteps = 0;
+  size_t drainSteps = 0;
+
+  // How searches ended. Blocked searches reached garbage that was being
+  // destroyed, or another search's proof, and merged ones were taken over by
+  // another search they ran into.
+  size_t searchesStarted = 0;
+  size_t searchesPoked = 0;
+  size_t searchesProvenLive = 0;
+  size_t searchesBlocked = 0;
+  size_t searchesMerged = 0;
+  size_t searchesCompleted = 0;
+
+  size_t blocksFreed = 0;
+  size_t bytesFreed = 0;
+  size_t pagesReleased = 0;  // Empty arena pages returned to the OS.
+  size_t blocksMoved = 0;    // Blocks moved by compaction.
 
+  // The longest time spent doing GC work in a single allocation.
+  std::chrono::nanoseconds maxAllocPause{0};
+
+  // searchLengths[i] is the number of searches that ended having visited
+  // between 2^i and 2^(i + 1) - 1 blocks.
+  size_t searchLengths[kSearchLengthBuckets] = {};
+
+  size_t numBlocks = 0;
+  size_t numYoung = 0;  // Blocks in the nursery.
+  size_t totalLinks = 0;
+  size_t arenaBytes = 0;  // Arena pages that haven't been returned to the OS.
+};
+
+// Receives a heap snapshot from the GC, a chunk at a time.
+using SnapshotSink = void (*)(const void *data, size_t size, void *context);
+
+// A heap snapshot is kSnapshotMagic, followed by a record for each block, in
+// order of id. Every number is an unsigned LEB128 varint. A record is the
+// block's id, its size in bytes including its header, its type tag, which is
+// its destructor (0 for trivially destructible types), its flags, and then a
+// code for each of its backlinks, ended by kSnapshotEnd.
+constexpr char kSnapshotMagic[9] = "BTGCSNP1";
+constexpr uint64_t kSnapshotLeaf = 1;  // Flags.
+constexpr uint64_t kSnapshotWeak = 2;
+constexpr uint64_t kSnapshotEnd = 0;      // Backlink codes.
+constexpr uint64_t kSnapshotRoot = 1;     // A root, rather than a block.
+constexpr uint64_t kSnapshotRetired = 2;  // Garbage queued for finalizing.
+constexpr uint64_t kSnapshotFirstId = 3;  // Block id + kSnapshotFirstId.
+
+template <class T>
+class Ptr;
+template <class T>
+class PtrArray;
+template <class T>
+class WeakPtr;
+template <class T>
+class Local;
+class HandleScope;
 class BTGC {
+  // Defining __BTGC_Compact__ shrinks the Block header from 40 to 24 bytes.
+  // The id is stored in 32 bits, the destructor is stored as an index into a
+  // table of per-type destructors, and the search marks live in a dense array
+  // indexed by id, rather than in each block.
+#ifdef __BTGC_Compact__
+  typedef uint32_t BlockId;
+  typedef uint16_t DtorRef;
+#else
+  typedef size_t BlockId;
+  typedef void (*DtorRef)(void *);
+#endif
+
+  // Trivially destructible types have no destructor to run, so collecting
+  // them skips the indirect call.
+#ifdef __BTGC_Compact__
+  static constexpr DtorRef kTrivialDtor = 0;
+#else
+  static constexpr DtorRef kTrivialDtor = nullptr;
+#endif
+
+  // Each block heads a circular list of its backlinks, so the list's nodes
+  // are Links, apart from the Block itself. Both derive from Node, and the list
+  // is walked through Nodes, rather than one type being punned as the other.
+  struct Node {
+    Node *next, *prev;
+  };
+
   struct Block;
-  struct Link {
-    Link *next, *prev;  // Keep at start, to match Block.
+  struct Link : Node {
     Block *from, *to;
     Link();
     Link(const Link &blocklink);
+    Link(Link &&blocklink);
     explicit Link(Block *_from);
     Link(Block *_from, Block *_to);
     ~Link();
     void link(Block *_to);
     void *ptr() const;
     Link &operator=(const Link &blocklink);
+    Link &operator=(Link &&blocklink);
+    void replace(Link &blocklink);
   };
 
-  struct Block {
-    Link *next, *prev;     // Keep at start, to match Link.
-    size_t id;             // Position in BTGC::blocks.
-    void (*dtor)(void *);  // Destructor for the pointer.
-    bool visited;
-    Block(size_t _id, void (*_dtor)(void *))
-        : next((Link *)this),
-          prev((Link *)this),
-          id(_id),
+  struct Block : Node {
+    BlockId id;    // Position in BTGC::blocks.
+    DtorRef dtor;  // Destructor for the pointer.
+#ifdef __BTGC_Compact__
+    uint8_t leaf : 1;         // Whether the block's type is a btgc::leaf.
+    uint8_t relocatable : 1;  // Whether compaction can move the block.
+    uint8_t sizeClass : 6;    // Arena size class the block was allocated from.
+    uint8_t weak : 1;         // Whether the block has a WeakCell.
+#else
+    uint32_t visit : 23;       // Stamp of the search that last visited it.
+    uint32_t leaf : 1;         // Whether the block's type is a btgc::leaf.
+    uint32_t relocatable : 1;  // Whether compaction can move the block.
+    uint32_t sizeClass : 6;    // Arena size class the block was allocated from.
+    uint32_t weak : 1;         // Whether the block has a WeakCell.
+    uint32_t live;             // BTGC::liveEpoch when it was proven live.
+#endif
+    Block(size_t _id, DtorRef _dtor, uint8_t _sizeClass, bool _leaf,
+          bool _relocatable)
+        : Node{this, this},
+          id((BlockId)_id),
           dtor(_dtor),
-          visited(false) {}
+#ifndef __BTGC_Compact__
+          visit(0),
+#endif
+          leaf(_leaf),
+          relocatable(_leaf && _relocatable),
+          sizeClass(_sizeClass),
+          weak(0) {
+#ifndef __BTGC_Compact__
+      live = 0;
+#endif
+    }
     void *ptr() const { return (void *)(this + 1); }
-    void finalize() { dtor(ptr()); }
+#ifdef __BTGC_Compact__
+    void finalize() {
+      if (dtor != kTrivialDtor) dtors()[dtor](ptr());
+    }
+#else
+    void finalize() {
+      if (dtor != kTrivialDtor) dtor(ptr());
+    }
+#endif
+  };
+
+  // Shared by all the WeakPtrs to a block. Weak references aren't backlinks,
+  // so searches never see them. Instead, the block is flagged, and its cell is
+  // found in BTGC::weakCells when the block is finalized, which clears the
+  // cell's target.
+  struct WeakCell {
+    Block *target;   // Or nullptr, once the target has been finalized.
+    WeakCell *next;  // Next cell in the same bucket of weakCells.
+    size_t refs;     // Number of WeakPtrs sharing the cell.
   };
 
-  enum class Mode { initialize, search, clear, finalize, destroy };
+  enum class Mode { initialize, search, prove, finalize, destroy, retire };
+
+  // Id of a block that has been removed from blocks, because it's garbage that
+  // is waiting to be finalized or freed.
+  static constexpr BlockId kRetired = (BlockId)-1;
+
+  // Maximum number of searches that can be in flight at once.
+  static constexpr size_t kMaxSearches = 16;
+
+  static constexpr size_t kNoProof = (size_t)-1;
+
+  // Search::sweep when no stale marks are waiting to be cleared.
+  static constexpr size_t kNoSweep = (size_t)-1;
+
+  // Search stamps are 23 bits, to fit next to Block's flags, or a whole
+  // uint32_t in the compact layout. The low bits of a stamp are the index of
+  // its search, and the rest count that search's visits, so the search that
+  // owns a mark is found without a lookup. Each search uses the lower half of
+  // the range, then the upper half, and so on.
+#ifdef __BTGC_Compact__
+  static constexpr uint64_t kMaxStamp = (uint64_t)1 << 32;
+#else
+  static constexpr uint64_t kMaxStamp = 1 << 23;
+#endif
+  static constexpr uint64_t kHalfStamp = kMaxStamp / 2;
+
+  // The state of one back-trace search. Several searches can be in flight at
+  // once, each exploring its own sub-graph, and the GC's steps are shared
+  // between them round robin. Blocks visited by a search are marked with its
+  // current stamp, so a poke only aborts the search that owns the block. When
+  // a search ends, it moves on to a new stamp, which clears all its marks at
+  // once, rather than resetting every block it visited. Marks left from the
+  // other half of its stamps are swept a few blocks per restamp, so they're
+  // gone before that half comes round again.
+  //
+  // The stack holds indices into the list, and parents holds the index of the
+  // block each block was found from. So when a root is reached, the path back
+  // to the seed is known, and every block on it can be stamped as live.
+  struct Search {
+    Array<size_t> stack;
+    Array<Block *> *list;
+    Array<size_t> parents;
+    size_t pos;
+    size_t cur;    // Index of blk in list.
+    Block *blk;
+    Node *link;    // Next of blk's backlinks, or blk once they're all done.
+    Mode mode;
+    uint32_t stamp;
+    size_t proof;  // Next block to stamp as live, or kNoProof.
+    uint32_t proofEpoch;
+    bool uniform;  // Whether the seed was sampled uniformly from blocks.
+    size_t sweep;  // Next block to clear of stale marks, or kNoSweep.
+  };
 
   struct Rand {
     // Poor quality but super fast random number generator, based on FNV hash.
@@ -112,157 +654,1257 @@ class BTGC {
     }
   };
 
-  Array<Block *> blocks;
+#ifdef __BTGC_Background__
+  // Collector thread, which runs the initialize, search and clear steps while
+  // the owning thread is idle. The mutex is held by the collector all the time
+  // it's stepping, so taking it guarantees the collector is parked.
+  struct Background {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool idle = false;              // Guarded by mutex.
+    bool stop = false;              // Guarded by mutex.
+    std::atomic<bool> yield{false};  // Asks the collector to park.
+  };
+#endif
+
+  // Snapshots are sent to their sink in chunks of at most this many bytes.
+  static constexpr size_t kSnapshotChunk = 1 << 16;
+
+  // A heap snapshot part way through being written. Blocks are only removed
+  // from blocks by GC work, which is suspended until the snapshot is finished,
+  // so every block is written once, including those allocated meanwhile.
+  struct Snapshot {
+    SnapshotSink sink;
+    void *context;
+    size_t pos;   // Next block to write.
+    size_t used;  // Bytes of chunk that hold data.
+    uint8_t chunk[kSnapshotChunk];
+  };
+
+  // Garbage freed by destroyStep is just pushed onto its page's free list, so
+  // each step releases a run of blocks rather than just one.
+  static constexpr size_t kDestroyBatch = 16;
+
+  // Empty pages returned to the OS after each run of frees. Each takes a
+  // system call, so only a few are returned at a time.
+  static constexpr size_t kReleaseBatch = 4;
+
+  // Search steps one search runs back to back, before the next search gets a
+  // turn, so a run of links is followed without dispatching on the mode.
+  static constexpr size_t kSearchRun = 16;
+
+  // Number of slots in each chunk of handles for Locals.
+  static constexpr size_t kHandleChunk = 256;
+
+  // Number of steps collectFor runs between checks of the clock.
+  static constexpr size_t kStepsPerClockCheck = 64;
+
+  // Blocks that just lost their last backlink are garbage, and a search
+  // seeded from one concludes in a single step. Finalizing such a block unlinks
+  // its children in turn, so whole garbage trees are collected this way. Their
+  // ids are kept in a ring of candidate seeds, the newest are tried first, and
+  // the oldest are overwritten when it's full. Ids go stale as blocks are
+  // unregistered, which just makes for a different seed.
+  static constexpr size_t kMaxCandidates = 256;
+
+  // Most blocks die young, so new blocks start in a nursery, which seeds are
+  // taken from in turn, oldest first, rather than at random. Blocks that are
+  // still there after kPromoteCycles sweeps of the nursery are promoted, and
+  // after that are only found by uniform seeds. So that a sweep doesn't take
+  // too long, the nursery is at most 1/2^kNurseryShift of blocks, and its
+  // oldest blocks are promoted early to keep it that size. Every
+  // kUniformInterval seeds is sampled uniformly from all of blocks, to find
+  // old garbage, and to keep the waste estimate unbiased.
+  static constexpr size_t kPromoteCycles = 2;
+  static constexpr size_t kNurseryShift = 3;
+  static constexpr size_t kUniformInterval = 4;
+
+  // Tuning of the adaptive effort controller. The garbage rate is a moving
+  // average over conclusive searches, and effort is adjusted every
+  // kAdaptInterval of them, by at most a factor of kMaxEffortChange.
+  static constexpr double kGarbageRateWeight = 1.0 / 64;
+  static constexpr size_t kAdaptInterval = 32;
+  static constexpr double kMaxEffortChange = 1.1;
+  static constexpr double kMinEffort = 1.0 / 16;
+  static constexpr double kMaxEffort = 64;
+
+  Arena arena;
+  ChunkedArray<Block *> blocks;
+
+  // Old blocks come first in blocks, and the nursery is the rest. A sweep of
+  // the nursery ends once nurseryCursor reaches the back, and sweepStarts
+  // remembers where the nursery ended when each of the last kPromoteCycles
+  // sweeps started, so everything before the oldest has been swept enough.
+  size_t numOld;
+  size_t nurseryCursor;
+  size_t sweepStarts[kPromoteCycles];
+  size_t sweepTurn;
+#ifdef __BTGC_Compact__
+  ChunkedArray<uint32_t> visits;  // Indexed by Block::id.
+  ChunkedArray<uint32_t> lives;   // Indexed by Block::id.
+#endif
+
+  // Blocks stamped with the current liveEpoch were recently proven reachable
+  // from a root, so a search that reaches one can stop. Every block on the
+  // path from the root is stamped, so removing any link to a stamped block
+  // could break a proof, and moves to a new epoch.
+  uint32_t liveEpoch;
   Rand rand;
+  BlockId candidates[kMaxCandidates];
+  size_t candidateTop;  // Position of the newest candidate.
+  size_t numCandidates;
+  size_t seedTurn;
   size_t totalLinks;
-  Array<Block *> searchStack;
-  Array<Block *> searchList;
-  size_t pos;
-  Block *searchBlk;
-  Link *searchLink;
-  Mode mode;
+  Search searches[kMaxSearches];
+  size_t numSearches;
+  size_t nextSearch;
+  Array<Array<Block *> *> spareLists;
+  Array<WeakCell *> weakCells;  // Hash table, keyed by WeakCell::target.
+  size_t numWeakCells;
+
+  // Blocks held by Locals, innermost HandleScope last. Locals are roots
+  // without backlinks, so a search that hasn't reached a root checks here
+  // for blocks it has visited before concluding they're garbage. The slots
+  // are in chunks that never move, so a Local can point straight at its slot.
+  Array<Block **> handleChunks;
+  size_t numHandles;
+  size_t numScopes;  // HandleScopes that haven't been destroyed yet.
   double effort;
+  bool collectOnAlloc;
+
+  // Garbage that has been found, but not yet finalized. Each batch is the list
+  // of one successful search. Blocks in different batches never point to each
+  // other, so a batch can be freed as soon as all its blocks are finalized.
+  // If queueFinalize is set, the queue is only drained by finalizeSteps and
+  // finalizeFor, otherwise GC work drains it before doing anything else.
+  bool queueFinalize;
+  bool deferFinalize;
+  Array<Array<Block *> *> retired;
+  size_t retiredBatch;  // First batch that hasn't been freed.
+  size_t retiredPos;    // First block in that batch that isn't finalized.
+  size_t retiredFreed;  // First block in that batch that isn't freed.
+
+  double targetWaste;
+  double targetStepsPerAlloc;
+  double garbageRate;
+  size_t searchesSinceAdapt;
+  double stepCredit;
+#ifdef __BTGC_Background__
+  Background *background;
+#endif
+  Snapshot *snapshot;
+
+  // A compaction in progress looks at each block in turn, from compactCursor,
+  // and moves it if it's relocatable and on a sparse page. The cells it moved
+  // from are freed once Locals have been pointed at the new ones.
+  bool compacting;
+  size_t compactCursor;
+  Array<Block *> moved;
+#ifdef __BTGC_Stats__
+  Stats counters;
+#endif
 
-  static BTGC *inst;
+  // Each thread has its own GC, with its own blocks, search state and arena.
+  static thread_local BTGC *inst;
+
+#ifdef __BTGC_Compact__
+  // Shared by all threads, so it's a fixed size table that is never moved.
+  static constexpr size_t kMaxTypes = 1 << 16;
+
+  static void (**dtors())(void *) {
+    static void (*table[kMaxTypes])(void *);
+    return table;
+  }
+
+  static DtorRef registerDtor(void (*dtor)(void *)) {
+    static std::atomic<size_t> numTypes(kTrivialDtor + 1);
+    size_t i = numTypes++;
+    // A DtorRef is 16 bits, so more types can't be told apart.
+    if (i >= kMaxTypes) std::abort();
+    dtors()[i] = dtor;
+    return (DtorRef)i;
+  }
+
+  uint32_t visit(const Block *blk) {
+    return blk->id == kRetired ? 0 : visits[blk->id];
+  }
+  void setVisit(Block *blk, uint32_t stamp) { visits[blk->id] = stamp; }
+  uint32_t live(const Block *blk) {
+    return blk->id == kRetired ? 0 : lives[blk->id];
+  }
+  void setLive(Block *blk, uint32_t epoch) { lives[blk->id] = epoch; }
+  static uint64_t typeTag(const Block *blk) { return blk->dtor; }
+#else
+  static DtorRef registerDtor(void (*dtor)(void *)) { return dtor; }
+  uint32_t visit(const Block *blk) { return blk->visit; }
+  void setVisit(Block *blk, uint32_t stamp) { blk->visit = stamp; }
+  uint32_t live(const Block *blk) { return blk->live; }
+  void setLive(Block *blk, uint32_t epoch) { blk->live = epoch; }
+  static uint64_t typeTag(const Block *blk) {
+    return (uint64_t) reinterpret_cast<uintptr_t>(blk->dtor);
+  }
+#endif
+
+  Search *visitor(const Block *blk) {
+    // The search that is currently visiting the block, if any.
+    uint32_t stamp = visit(blk);
+    Search &s = searches[stamp % kMaxSearches];
+    return s.stamp == stamp ? &s : nullptr;
+  }
+
+  bool stale(uint32_t stamp) {
+    // Whether a mark is from the half of its search's stamps not in use.
+    const Search &s = searches[stamp % kMaxSearches];
+    return stamp != 0 && (stamp >= kHalfStamp) != (s.stamp >= kHalfStamp);
+  }
+
+  void restamp(Search &s) {
+    // Invalidate the search's marks. On moving into the other half of its
+    // stamps, a sweep starts clearing the marks left in the half it just left.
+    size_t index = s.stamp % kMaxSearches;
+    bool upper = s.stamp >= kHalfStamp;
+    uint64_t stamp = (uint64_t)s.stamp + kMaxSearches;
+    if (stamp >= kMaxStamp) stamp = kMaxSearches + index;
+    s.stamp = (uint32_t)stamp;
+    if ((s.stamp >= kHalfStamp) != upper) s.sweep = 0;
+    sweepStep(s);
+  }
+
+  void sweepStep(Search &s) {
+    // Clear the next part of the search's stale marks, paced so the sweep
+    // is done by the last restamp before the stamps wrap into its half again.
+    // Retired blocks are unmarked when they're retired, so only blocks need
+    // sweeping, and a block that moves behind the sweep is cleared by
+    // moveBlock.
+    uint64_t end = s.stamp >= kHalfStamp ? kMaxStamp : kHalfStamp;
+    size_t restamps = (size_t)((end - s.stamp - 1) / kMaxSearches + 1);
+    if (s.sweep >= blocks.size()) return;
+    size_t n = (blocks.size() - s.sweep + restamps - 1) / restamps;
+    for (size_t i = s.sweep; i < s.sweep + n; ++i) {
+      if (stale(visit(blocks[i]))) setVisit(blocks[i], 0);
+    }
+    s.sweep += n;
+  }
+
+  static bool rooted(const Block *blk) {
+    // Roots are linked at the front of a block's backlinks, and non-roots at
+    // the back, so a block is held by a root exactly when its first backlink
+    // is one. This answers it in O(1), however many backlinks blk has.
+    return blk->next != blk &&
+           static_cast<const Link *>(blk->next)->from == nullptr;
+  }
+
+  void unlinked(Block *blk, bool last) {
+    // A link to blk is being removed. If it's the last one, which is when both
+    // its neighbours are blk itself, then blk is garbage.
+    if (last && blk->id != kRetired) {
+      candidateTop = (candidateTop + 1) % kMaxCandidates;
+      candidates[candidateTop] = blk->id;
+      if (numCandidates < kMaxCandidates) ++numCandidates;
+    }
+    if (live(blk) == liveEpoch) {
+      ++liveEpoch;
+      if (liveEpoch == 0) {
+        // Wrapped around, so old stamps could look current. This happens once
+        // every 2^32 epochs.
+        for (size_t i = 0; i < blocks.size(); ++i) setLive(blocks[i], 0);
+        liveEpoch = 1;
+      }
+    }
+  }
 
   void finalize(Block *blk) {
     // Finalize and call all destructors, but don't actually free the memory.
     // This can never be called except when its entire sub-graph is being
     // deleted. Therefore, we don't need to worry about fixing its backlinks.
-    size_t blkid = blk->id;
-    blocks.del(blkid);
-    blocks[blkid]->id = blkid;
+    unregister(blk);
+    destruct(blk);
+  }
+
+  void destruct(Block *blk) {
+    // Run the destructor, after expiring any weak references.
+    if (blk->weak) expireWeak(blk);
     blk->finalize();
   }
 
+  WeakCell *&weakBucket(const Block *blk) {
+    size_t h = (uintptr_t)blk / Arena::kGranule;
+    return weakCells[(h ^ (h >> 16)) & (weakCells.size() - 1)];
+  }
+
+  WeakCell *weakRef(Block *blk) {
+    // Adds a weak reference to blk, sharing its cell if it already has one.
+    if (blk == nullptr) return nullptr;
+    WeakCell *cell;
+    if (blk->weak) {
+      cell = weakBucket(blk);
+      while (cell->target != blk) cell = cell->next;
+    } else {
+      if (numWeakCells >= weakCells.size()) growWeakCells();
+      WeakCell *&bucket = weakBucket(blk);
+      cell = new WeakCell{blk, bucket, 0};
+      bucket = cell;
+      ++numWeakCells;
+      blk->weak = 1;
+    }
+    ++cell->refs;
+    return cell;
+  }
+
+  void weakUnref(WeakCell *cell) {
+    if (--cell->refs > 0) return;
+    if (cell->target != nullptr) {
+      cell->target->weak = 0;
+      removeWeakCell(cell);
+    }
+    delete cell;
+  }
+
+  void expireWeak(Block *blk) {
+    WeakCell *cell = weakBucket(blk);
+    while (cell->target != blk) cell = cell->next;
+    removeWeakCell(cell);
+    cell->target = nullptr;
+    blk->weak = 0;
+  }
+
+  void removeWeakCell(WeakCell *cell) {
+    WeakCell **p = &weakBucket(cell->target);
+    while (*p != cell) p = &(*p)->next;
+    *p = cell->next;
+    --numWeakCells;
+  }
+
+  void growWeakCells() {
+    // Double the number of buckets, so there's at most one cell per bucket on
+    // average.
+    Array<WeakCell *> cells;
+    for (size_t i = 0; i < weakCells.size(); ++i) {
+      for (WeakCell *cell = weakCells[i]; cell != nullptr; cell = cell->next) {
+        cells.add(cell);
+      }
+    }
+    size_t n = weakCells.size() > 0 ? 2 * weakCells.size() : 1;
+    weakCells.clear();
+    for (size_t i = 0; i < n; ++i) weakCells.add(nullptr);
+    for (size_t i = 0; i < cells.size(); ++i) {
+      WeakCell *&bucket = weakBucket(cells[i]->target);
+      cells[i]->next = bucket;
+      bucket = cells[i];
+    }
+  }
+
+  bool dying(Block *blk) {
+    // Whether the block has been found to be garbage, but not yet finalized.
+    if (blk->id == kRetired) return true;
+    Search *s = visitor(blk);
+    return s != nullptr &&
+           (s->mode == Mode::finalize || s->mode == Mode::retire);
+  }
+
+  void retire(Block *blk) {
+    // Like finalize, but leaves the destructor to be run by drainStep.
+    unregister(blk);
+#ifndef __BTGC_Compact__
+    blk->visit = 0;
+#endif
+  }
+
+  void unregister(Block *blk) {
+    // Remove the block from blocks, so it won't be picked as a search seed.
+    // The last block fills the hole, but old blocks are kept in front of the
+    // nursery, so an old block's hole is filled by the last old block first.
+    size_t hole = blk->id;
+    if (hole < numOld) {
+      --numOld;
+      moveBlock(numOld, hole);
+      hole = numOld;
+    }
+    size_t last = blocks.size() - 1;
+    if (last != hole) moveBlock(last, hole);
+#ifdef __BTGC_Compact__
+    visits[last] = 0;
+    lives[last] = 0;
+#endif
+    blocks.pop();
+    blk->id = kRetired;
+  }
+
+  void moveBlock(size_t from, size_t to) {
+    // Move the block at from to to, along with its marks.
+#ifdef __BTGC_Compact__
+    visits[to] = visits[from];
+    lives[to] = lives[from];
+#endif
+    blocks[to] = blocks[from];
+    blocks[to]->id = (BlockId)to;
+    // The block may be moving behind a sweep, so it's swept here.
+    if (stale(visit(blocks[to]))) setVisit(blocks[to], 0);
+  }
+
   void del(Block *blk) {
     // Free the memory associated with the block. This assumes that
     // finalize(blk) has already been called.
-    __BTGC_Free__((void *)blk);
+    __BTGC_Stat__(++counters.blocksFreed);
+    __BTGC_Stat__(counters.bytesFreed += Arena::size(blk, blk->sizeClass));
+    arena.release((void *)blk, blk->sizeClass);
+  }
+
+  void poke(Block *blk) {
+    // If the block is visited (ie currently being processed) then the
+    // sub-graph that its search is exploring is not deletable.
+    // If the search is stamping a proof, the path may have changed.
+    Search *s = visitor(blk);
+    if (s != nullptr) {
+      if (s->mode == Mode::initialize || s->mode == Mode::search) {
+        __BTGC_Stat__(++counters.searchesPoked);
+        __BTGC_Stat__(countSearch(*s));
+        abort(*s);
+      }
+      s->proof = kNoProof;
+    }
+  }
+
+#ifdef __BTGC_Stats__
+  void countSearch(const Search &s) {
+    // Add the ended search to the histogram of search lengths.
+    size_t bucket = 0;
+    for (size_t n = s.list->size(); n > 1; n >>= 1) ++bucket;
+    if (bucket >= Stats::kSearchLengthBuckets) {
+      bucket = Stats::kSearchLengthBuckets - 1;
+    }
+    ++counters.searchLengths[bucket];
+  }
+#endif
+
+  void abort(Search &s) {
+    s.mode = Mode::initialize;
+    s.proof = kNoProof;
+    s.stack.clear();
+    s.parents.clear();
+    s.list->clear();
+    restamp(s);
+  }
+
+  void provenLive(Search &s) {
+    // The current block is reachable from a root, so the path back to the seed
+    // is stamped as live by proveStep. The path stays marked until then, so a
+    // poke on it cancels the proof.
+    s.mode = Mode::prove;
+    s.proof = s.cur;
+    s.proofEpoch = liveEpoch;
+    observeSearch(s, false);
+    __BTGC_Stat__(++counters.searchesProvenLive);
+    __BTGC_Stat__(countSearch(s));
+  }
+
+  Block *&handle(size_t i) {
+    return handleChunks[i / kHandleChunk][i % kHandleChunk];
+  }
+
+  Block **addHandle(Block *blk) {
+    // Only a HandleScope gives slots back, so a Local made outside one would
+    // hold its slot, and be scanned by every search, for the life of the GC.
+    assert(numScopes > 0 && "Locals must be made inside a HandleScope");
+    if (numHandles == handleChunks.size() * kHandleChunk) {
+      handleChunks.add(new Block *[kHandleChunk]);
+    }
+    Block **slot = &handle(numHandles++);
+    *slot = blk;
+    return slot;
+  }
+
+  bool handled(const Search &s) {
+    // Whether a Local holds a block the search has visited.
+    for (size_t i = 0; i < numHandles; ++i) {
+      Block *blk = handle(i);
+      if (blk != nullptr && visit(blk) == s.stamp) return true;
+    }
+    return false;
+  }
+
+  void relocated(Link *oldLink, Link *newLink) {
+    // A link has moved, and a search may be part way through its list.
+    for (size_t i = 0; i < numSearches; ++i) {
+      if (searches[i].link == oldLink) searches[i].link = newLink;
+    }
+  }
+
+  void observeSearch(const Search &s, bool garbage) {
+    // For uniformly sampled seeds, the fraction of conclusive searches that
+    // find garbage estimates the fraction of blocks that are garbage. Searches
+    // aborted by a poke say nothing either way, and nor do biased seeds.
+    if (!s.uniform) return;
+    garbageRate += ((garbage ? 1 : 0) - garbageRate) * kGarbageRateWeight;
+    if (targetWaste <= 0 || ++searchesSinceAdapt < kAdaptInterval) return;
+    searchesSinceAdapt = 0;
+    double change = estimatedWaste() / targetWaste;
+    if (change > kMaxEffortChange) change = kMaxEffortChange;
+    if (change < 1 / kMaxEffortChange) change = 1 / kMaxEffortChange;
+    effort *= change;
+    if (effort > kMaxEffort) effort = kMaxEffort;
+    if (effort < kMinEffort) effort = kMinEffort;
+  }
+
+  double estimatedWaste() const {
+    // Garbage as a percentage of live blocks.
+    if (garbageRate >= 1) return kMaxEffortChange * targetWaste + 100;
+    return 100 * garbageRate / (1 - garbageRate);
+  }
+
+  Block *pickSeed(Search &s) {
+    // Prefer blocks that just lost their last backlink, then young blocks.
+    s.uniform = ++seedTurn % kUniformInterval == 0;
+    if (!s.uniform) {
+      while (numCandidates > 0) {
+        BlockId id = candidates[candidateTop];
+        candidateTop = (candidateTop + kMaxCandidates - 1) % kMaxCandidates;
+        --numCandidates;
+        if (id < blocks.size()) return blocks[id];
+      }
+      size_t maxNursery = (blocks.size() >> kNurseryShift) + 1;
+      if (blocks.size() - numOld > maxNursery) {
+        numOld = blocks.size() - maxNursery;
+      }
+      if (nurseryCursor < numOld) nurseryCursor = numOld;
+      if (nurseryCursor >= blocks.size()) endSweep();
+      if (nurseryCursor < blocks.size()) return blocks[nurseryCursor++];
+    }
+    return blocks[rand(blocks.size())];
+  }
+
+  void endSweep() {
+    // Promote the blocks that were in the nursery when the oldest remembered
+    // sweep started, and start a new sweep.
+    size_t promoted = sweepStarts[sweepTurn];
+    if (promoted > blocks.size()) promoted = blocks.size();
+    if (promoted > numOld) numOld = promoted;
+    sweepStarts[sweepTurn] = blocks.size();
+    sweepTurn = (sweepTurn + 1) % kPromoteCycles;
+    nurseryCursor = numOld;
+  }
+
+  void initializeStep(Search &s) {
+    if (s.stack.size() == 0) {
+      if (blocks.size() == 0) {
+        return;
+      }
+      Block *seed = pickSeed(s);
+      if (rooted(seed)) {
+        observeSearch(s, false);
+        return;
+      }
+      if (seed->leaf && seed->next != seed) {
+        // A leaf is garbage exactly when all its parents are, and finalizing
+        // them would leave it without backlinks, making it a candidate. So
+        // search from a parent instead, which can also collect more.
+        seed = static_cast<Link *>(seed->next)->from;
+        if (seed->id == kRetired) return;
+      }
+      if (visitor(seed) != nullptr) {
+        // Already part of another search.
+        return;
+      }
+      if (live(seed) == liveEpoch || rooted(seed)) {
+        // Recently proven live, or held by a root.
+        observeSearch(s, false);
+        return;
+      }
+      __BTGC_Stat__(++counters.searchesStarted);
+      s.blk = seed;
+      s.cur = 0;
+      setVisit(s.blk, s.stamp);
+      s.list->add(s.blk);
+      s.parents.add(0);
+    } else {
+      s.cur = s.stack.pop();
+      s.blk = (*s.list)[s.cur];
+    }
+    s.mode = Mode::search;
+    s.link = s.blk->next;
+  }
+
+  void searchStep(Search &s) {
+    if (s.link == s.blk) {
+      if (s.stack.size() == 0) {
+        if (handled(s)) {
+          // Held by a Local, which is a root too.
+          observeSearch(s, false);
+          __BTGC_Stat__(++counters.searchesProvenLive);
+          __BTGC_Stat__(countSearch(s));
+          abort(s);
+          return;
+        }
+        // Root not reached, delete.
+        s.mode = deferFinalize ? Mode::retire : Mode::finalize;
+        s.pos = 0;
+        observeSearch(s, true);
+        __BTGC_Stat__(++counters.searchesCompleted);
+        __BTGC_Stat__(countSearch(s));
+        __BTGC_ReportCollection__(s.list->size());
+        return;
+      }
+      s.mode = Mode::initialize;
+      return;
+    }
+
+    Block *from = static_cast<Link *>(s.link)->from;
+    if (from == nullptr || live(from) == liveEpoch) {
+      // Root has been reached, don't delete.
+      provenLive(s);
+      return;
+    }
+    if (visit(from) != s.stamp) {
+      Search *other = visitor(from);
+      if (other != nullptr && (other->mode == Mode::initialize ||
+                               other->mode == Mode::search)) {
+        // Reached a sub-graph that another search is exploring. Neither can
+        // conclude without the other, so the smaller one is merged into the
+        // larger one, which carries on. This way large garbage is still
+        // collected when many searches start inside it.
+        __BTGC_Stat__(++counters.searchesMerged);
+        if (other->list->size() > s.list->size()) {
+          merge(*other, s);
+          return;
+        }
+        merge(s, *other);
+        s.link = s.link->next;
+        return;
+      }
+      if (other != nullptr || from->id == kRetired) {
+        // Reached a sub-graph that is being proven live or destroyed, or
+        // garbage whose destructor will unlink it from this sub-graph. Either
+        // way, this search can't be concluded yet.
+        __BTGC_Stat__(++counters.searchesBlocked);
+        __BTGC_Stat__(countSearch(s));
+        abort(s);
+        return;
+      }
+      setVisit(from, s.stamp);
+      s.list->add(from);
+      s.parents.add(s.cur);
+      if (rooted(from)) {
+        // Checking now, rather than when from is searched, means a block with
+        // a huge number of backlinks is proven live by the first rooted one,
+        // instead of after all of them have been added to the stack.
+        s.cur = s.list->size() - 1;
+        provenLive(s);
+        return;
+      }
+      s.stack.add(s.list->size() - 1);
+    }
+    s.link = s.link->next;
+  }
+
+  size_t searchRun(Search &s, size_t budget) {
+    // Runs up to budget steps of a search, for as long as it keeps searching,
+    // and returns how many ran. Each link's block is elsewhere in memory, so
+    // while one link is searched, the next link's block, and the link after
+    // that, are prefetched. Popping the next block off the stack counts as a
+    // step too, and starts on its backlinks.
+    size_t n = 0;
+    do {
+      if (s.mode == Mode::initialize) {
+        __BTGC_Stat__(++counters.initializeSteps);
+        initializeStep(s);
+        __BTGC_Prefetch__(s.link);
+      } else {
+        __BTGC_Stat__(++counters.searchSteps);
+        if (s.link != s.blk) {
+          Node *next = s.link->next;
+          if (next != s.blk) {
+            __BTGC_Prefetch__(static_cast<Link *>(next)->from);
+            __BTGC_Prefetch__(next->next);
+          }
+        }
+        searchStep(s);
+      }
+      ++n;
+    } while (n < budget &&
+             (s.mode == Mode::search ||
+              (s.mode == Mode::initialize && s.stack.size() > 0)));
+    return n;
+  }
+
+  void proveStep(Search &s) {
+    // Stamp the next block on the path from the root back to the seed. If a
+    // link to a stamped block was removed, the proof may be stale.
+    if (s.proof == kNoProof || s.proofEpoch != liveEpoch) {
+      abort(s);
+      return;
+    }
+    setLive((*s.list)[s.proof], s.proofEpoch);
+    if (s.parents[s.proof] == s.proof) {
+      // Reached a seed, which is its own parent.
+      abort(s);
+      return;
+    }
+    s.proof = s.parents[s.proof];
+  }
+
+  void merge(Search &into, Search &from) {
+    // Move from's blocks and pending work into into, and reset from. If from
+    // was part way through a block's backlinks, that block is searched again.
+    size_t base = into.list->size();
+    Array<Block *> &list = *from.list;
+    for (size_t i = 0; i < list.size(); ++i) {
+      setVisit(list[i], into.stamp);
+      into.list->add(list[i]);
+      into.parents.add(base + from.parents[i]);
+    }
+    for (size_t i = 0; i < from.stack.size(); ++i) {
+      into.stack.add(base + from.stack[i]);
+    }
+    if (from.mode == Mode::search) into.stack.add(base + from.cur);
+    abort(from);
+  }
+
+  void finalizeStep(Search &s) {
+    finalize((*s.list)[s.pos]);
+    ++s.pos;
+    if (s.pos >= s.list->size()) {
+      s.mode = Mode::destroy;
+      s.pos = 0;
+      restamp(s);
+    }
+  }
+
+  void destroyStep(Search &s) {
+    Array<Block *> &list = *s.list;
+    size_t end = s.pos + kDestroyBatch;
+    if (end > list.size()) end = list.size();
+    for (; s.pos < end; ++s.pos) del(list[s.pos]);
+    releasePages(kReleaseBatch);
+    if (s.pos >= list.size()) {
+      s.mode = Mode::initialize;
+      s.parents.clear();
+      list.clear();
+    }
+  }
+
+  void retireStep(Search &s) {
+    retire((*s.list)[s.pos]);
+    ++s.pos;
+    if (s.pos >= s.list->size()) {
+      // Hand the whole list over to the retired queue.
+      retired.add(s.list);
+      s.list = newList();
+      s.parents.clear();
+      s.mode = Mode::initialize;
+      restamp(s);
+    }
+  }
+
+  void releasePages(size_t maxPages) {
+    size_t n = arena.trim(maxPages);
+    __BTGC_Stat__(counters.pagesReleased += n);
+    (void)n;
+  }
+
+  Array<Block *> *newList() {
+    return spareLists.size() > 0 ? spareLists.pop() : new Array<Block *>();
+  }
+
+  bool hasRetired() const { return retiredBatch < retired.size(); }
+
+  void drainStep() {
+    // Finalize the next retired block, or if its whole batch is finalized, free
+    // a run of the batch's blocks.
+    __BTGC_Stat__(++counters.drainSteps);
+    Array<Block *> &batch = *retired[retiredBatch];
+    if (retiredPos < batch.size()) {
+      destruct(batch[retiredPos]);
+      ++retiredPos;
+      return;
+    }
+    size_t end = retiredFreed + kDestroyBatch;
+    if (end > batch.size()) end = batch.size();
+    for (; retiredFreed < end; ++retiredFreed) del(batch[retiredFreed]);
+    releasePages(kReleaseBatch);
+    if (retiredFreed < batch.size()) return;
+    batch.clear();
+    spareLists.add(&batch);
+    retiredPos = 0;
+    retiredFreed = 0;
+    ++retiredBatch;
+    if (retiredBatch * 2 >= retired.size()) {
+      // Drop the freed batches from the front of the queue.
+      size_t n = retired.size() - retiredBatch;
+      for (size_t i = 0; i < n; ++i) retired[i] = retired[retiredBatch + i];
+      retired.truncate(n);
+      retiredBatch = 0;
+    }
+  }
+
+  bool busy() const {
+    // Whether there's any GC work to do, even with an empty heap.
+    if (hasRetired() && !queueFinalize) return true;
+    for (size_t i = 0; i < numSearches; ++i) {
+      if (searches[i].mode != Mode::initialize) return true;
+    }
+    return false;
+  }
+
+#ifdef __BTGC_Background__
+  bool canStepInBackground(const Search &s) const {
+    // Only searching and retiring run in the background. Finalizing runs user
+    // destructors, so it's left for the owning thread, which drains retired.
+    if (s.mode == Mode::finalize || s.mode == Mode::destroy) return false;
+    return blocks.size() > 0 || s.mode != Mode::initialize;
+  }
+
+  bool backgroundStep() {
+    // Step the next search that can run in the background, if there is one.
+    for (size_t i = 0; i < numSearches; ++i) {
+      Search &s = searches[nextSearch];
+      if (++nextSearch == numSearches) nextSearch = 0;
+      if (canStepInBackground(s)) {
+        if (s.mode == Mode::search) {
+          searchRun(s, kSearchRun);
+        } else {
+          step(s);
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool canSearchInBackground() const {
+    if (snapshot != nullptr) return false;
+    for (size_t i = 0; i < numSearches; ++i) {
+      if (canStepInBackground(searches[i])) return true;
+    }
+    return false;
+  }
+
+  void backgroundLoop() {
+    std::unique_lock<std::mutex> lock(background->mutex);
+    for (;;) {
+      background->wake.wait(lock, [this] {
+        return background->stop ||
+               (background->idle && !background->yield.load() &&
+                canSearchInBackground());
+      });
+      if (background->stop) return;
+      while (!background->yield.load(std::memory_order_relaxed) &&
+             backgroundStep()) {
+      }
+    }
+  }
+
+  void stopBackgroundThread() {
+    if (background == nullptr) return;
+    // The collector holds the mutex while it's stepping, so ask it to park
+    // first, as endIdle does.
+    background->yield = true;
+    {
+      std::lock_guard<std::mutex> lock(background->mutex);
+      background->stop = true;
+    }
+    background->wake.notify_one();
+    background->thread.join();
+    delete background;
+    background = nullptr;
+    deferFinalize = queueFinalize;
+  }
+#endif
+
+  void step(Search &s) {
+    switch (s.mode) {
+      case Mode::initialize:
+        __BTGC_Stat__(++counters.initializeSteps);
+        initializeStep(s);
+        break;
+      case Mode::search:
+        __BTGC_Stat__(++counters.searchSteps);
+        searchStep(s);
+        break;
+      case Mode::prove:
+        __BTGC_Stat__(++counters.proveSteps);
+        proveStep(s);
+        break;
+      case Mode::finalize:
+        __BTGC_Stat__(++counters.finalizeSteps);
+        finalizeStep(s);
+        break;
+      case Mode::destroy:
+        __BTGC_Stat__(++counters.destroySteps);
+        destroyStep(s);
+        break;
+      case Mode::retire:
+        __BTGC_Stat__(++counters.retireSteps);
+        retireStep(s);
+        break;
+    }
+  }
+
+  size_t step(size_t budget) {
+    // Steps on the owning thread, which also finalizes retired garbage. Runs
+    // at least one and at most budget steps, and returns how many ran.
+    if (hasRetired() && !queueFinalize) {
+      drainStep();
+      return 1;
+    }
+    Search &s = searches[nextSearch];
+    if (++nextSearch == numSearches) nextSearch = 0;
+    if (s.mode == Mode::search) {
+      return searchRun(s, budget < kSearchRun ? budget : kSearchRun);
+    }
+    step(s);
+    return 1;
+  }
+
+  void runSteps(size_t n) {
+    if (snapshot != nullptr) return;
+    for (size_t i = 0; i < n;) i += step(n - i);
+  }
+
+  void collect(size_t allocs) {
+    // Do the GC work owed for the given number of allocations.
+    if (collectOnAlloc && blocks.size() > 0) {
+      size_t stepCost = (2 * (totalLinks / blocks.size())) + 7;
+      if (targetStepsPerAlloc > 0) effort = targetStepsPerAlloc / stepCost;
+      // Carry over fractional steps, so that low efforts still do some work.
+      stepCredit += allocs * effort * stepCost;
+      size_t steps = stepCredit;
+      stepCredit -= steps;
+      if (steps == 0) return;
+      __BTGC_Stat__(auto start = std::chrono::steady_clock::now());
+      runSteps(steps);
+      __BTGC_Stat__(notePause(std::chrono::steady_clock::now() - start));
+    }
+  }
+
+  void snapshotPut(uint64_t value) {
+    // Append a varint to the chunk, sending the chunk first if it's nearly
+    // full.
+    Snapshot &snap = *snapshot;
+    if (snap.used + 10 > kSnapshotChunk) {
+      snap.sink(snap.chunk, snap.used, snap.context);
+      snap.used = 0;
+    }
+    while (value >= 0x80) {
+      snap.chunk[snap.used++] = (uint8_t)(value | 0x80);
+      value >>= 7;
+    }
+    snap.chunk[snap.used++] = (uint8_t)value;
+  }
+
+  bool snapshotStep(size_t n) {
+    // Write whole blocks until about n blocks and backlinks have been written.
+    // Once the last block has been written, send the last chunk, and finish.
+    size_t written = 0;
+    while (written < n && snapshot->pos < blocks.size()) {
+      Block *blk = blocks[snapshot->pos++];
+      snapshotPut(blk->id);
+      snapshotPut(Arena::size(blk, blk->sizeClass));
+      snapshotPut(typeTag(blk));
+      snapshotPut((blk->leaf ? kSnapshotLeaf : 0) |
+                  (blk->weak ? kSnapshotWeak : 0));
+      for (Node *node = blk->next; node != blk; node = node->next) {
+        Block *from = static_cast<Link *>(node)->from;
+        snapshotPut(from == nullptr          ? kSnapshotRoot
+                    : from->id == kRetired ? kSnapshotRetired
+                                           : from->id + kSnapshotFirstId);
+        ++written;
+      }
+      snapshotPut(kSnapshotEnd);
+      ++written;
+    }
+    if (snapshot->pos < blocks.size()) return true;
+    if (snapshot->used > 0) {
+      snapshot->sink(snapshot->chunk, snapshot->used, snapshot->context);
+    }
+    delete snapshot;
+    snapshot = nullptr;
+    return false;
   }
 
-  void poke(Block *blk) {
-    // If the block is visited (ie currently being processed) then the current
-    // sub-graph that is being searched is not deletable.
-    if (blk->visited && (mode == Mode::initialize || mode == Mode::search)) {
-      mode = Mode::clear;
-      pos = 0;
-    }
+#ifdef __BTGC_Stats__
+  void notePause(std::chrono::nanoseconds pause) {
+    if (pause > counters.maxAllocPause) counters.maxAllocPause = pause;
   }
+#endif
 
-  void initializeStep() {
-    if (searchStack.size() == 0) {
-      if (blocks.size() == 0) {
-        return;
+  size_t collectAllGarbage() {
+    // The sweep removes blocks, so an unfinished snapshot is written first.
+    while (snapshot != nullptr) snapshotStep((size_t)-1);
+
+    // Finish or abandon the searches in flight, since the sweep changes blocks.
+    for (size_t i = 0; i < numSearches; ++i) {
+      Search &s = searches[i];
+      if (s.mode == Mode::initialize || s.mode == Mode::search ||
+          s.mode == Mode::prove) {
+        abort(s);
       }
-      searchBlk = blocks[rand(blocks.size())];
-      searchBlk->visited = true;
-      searchList.add(searchBlk);
-    } else {
-      searchBlk = searchStack.pop();
+      while (s.mode != Mode::initialize) step(s);
     }
-    mode = Mode::search;
-    searchLink = searchBlk->next;
-  }
 
-  void searchStep() {
-    if (searchLink == (Link *)searchBlk) {
-      if (searchStack.size() == 0) {
-        // Root not reached, delete.
-        mode = Mode::finalize;
-        pos = 0;
-        __BTGC_ReportCollection__(searchList.size());
-        return;
+    // Build a forward index of the heap from the backlinks. The children of
+    // block i are edges[start[i]] to edges[start[i + 1] - 1]. Roots, Locals,
+    // and blocks that queued garbage points to, are marked up front. Queued
+    // garbage still unlinks from its children when it's finalized, so they
+    // must stay.
+    size_t n = blocks.size();
+    Array<size_t> start(n + 1);
+    Array<uint8_t> marked(n);
+    for (size_t i = 0; i <= n; ++i) start.add(0);
+    for (size_t i = 0; i < n; ++i) marked.add(0);
+    for (size_t i = 0; i < n; ++i) {
+      Block *blk = blocks[i];
+      for (Node *node = blk->next; node != blk; node = node->next) {
+        Block *from = static_cast<Link *>(node)->from;
+        if (from == nullptr || from->id == kRetired) {
+          marked[i] = 1;
+        } else {
+          ++start[from->id + 1];
+        }
+      }
+    }
+    for (size_t i = 0; i < numHandles; ++i) {
+      if (handle(i) != nullptr) marked[handle(i)->id] = 1;
+    }
+    for (size_t i = 0; i < n; ++i) start[i + 1] += start[i];
+    Array<size_t> edges(start[n] + 1);
+    for (size_t i = 0; i < start[n]; ++i) edges.add(0);
+    Array<size_t> fill(n);
+    for (size_t i = 0; i < n; ++i) fill.add(start[i]);
+    for (size_t i = 0; i < n; ++i) {
+      Block *blk = blocks[i];
+      for (Node *node = blk->next; node != blk; node = node->next) {
+        Block *from = static_cast<Link *>(node)->from;
+        if (from != nullptr && from->id != kRetired) {
+          edges[fill[from->id]++] = i;
+        }
       }
-      mode = Mode::initialize;
-      return;
     }
 
-    Block *from = searchLink->from;
-    if (from == nullptr) {
-      // Root has been reached, don't delete.
-      mode = Mode::clear;
-      pos = 0;
-      return;
+    // Mark everything reachable.
+    Array<size_t> stack;
+    for (size_t i = 0; i < n; ++i) {
+      if (marked[i]) stack.add(i);
     }
-    if (!from->visited) {
-      from->visited = true;
-      searchList.add(from);
-      searchStack.add(from);
+    while (stack.size() > 0) {
+      size_t i = stack.pop();
+      for (size_t e = start[i]; e < start[i + 1]; ++e) {
+        if (!marked[edges[e]]) {
+          marked[edges[e]] = 1;
+          stack.add(edges[e]);
+        }
+      }
     }
-    searchLink = searchLink->next;
-  }
 
-  void clearStep() {
-    searchList[pos]->visited = false;
-    ++pos;
-    if (pos >= searchList.size()) {
-      mode = Mode::initialize;
-      searchStack.clear();
-      searchList.clear();
+    // Sweep. The garbage is collected as one list, through the same paths as
+    // a successful search.
+    Array<Block *> *list = newList();
+    for (size_t i = 0; i < n; ++i) {
+      if (!marked[i]) list->add(blocks[i]);
     }
+    size_t collected = list->size();
+    if (collected > 0) __BTGC_ReportCollection__(list->size());
+    if (deferFinalize) {
+      for (size_t i = 0; i < collected; ++i) retire((*list)[i]);
+      retired.add(list);
+      return collected;
+    }
+    for (size_t i = 0; i < collected; ++i) finalize((*list)[i]);
+    for (size_t i = 0; i < collected; ++i) del((*list)[i]);
+    releasePages((size_t)-1);
+    list->clear();
+    spareLists.add(list);
+    return collected;
   }
 
-  void finalizeStep() {
-    finalize(searchList[pos]);
-    ++pos;
-    if (pos >= searchList.size()) {
-      mode = Mode::destroy;
-      pos = 0;
+  void relocate(Block *blk) {
+    // Copy the block to a cell on a dense page, and point its backlinks and
+    // weak cell at the copy. Its neighbours in its circular list of backlinks
+    // point at it too.
+    size_t size = Arena::size(blk, blk->sizeClass);
+    Block *to = (Block *)arena.allocate(size, blk->sizeClass);
+    std::memcpy((void *)to, (void *)blk, size);
+    if (to->next == blk) {
+      to->next = to->prev = to;
+    } else {
+      to->next->prev = to;
+      to->prev->next = to;
+      for (Node *n = to->next; n != to; n = n->next) {
+        static_cast<Link *>(n)->to = to;
+      }
+    }
+    blocks[to->id] = to;
+    if (to->weak) {
+      WeakCell *cell = weakBucket(blk);
+      while (cell->target != blk) cell = cell->next;
+      removeWeakCell(cell);
+      cell->target = to;
+      WeakCell *&bucket = weakBucket(to);
+      cell->next = bucket;
+      bucket = cell;
+      ++numWeakCells;
     }
+    __BTGC_Stat__(++counters.blocksMoved);
   }
 
-  void destroyStep() {
-    del(searchList[pos]);
-    ++pos;
-    if (pos >= searchList.size()) {
-      mode = Mode::initialize;
-      searchList.clear();
+  bool compactStep(size_t n) {
+    // Look at up to n more blocks, and return whether there are more.
+    if (!compacting) {
+      if (arena.beginEvacuation() == 0) return false;
+      compacting = true;
+      compactCursor = 0;
     }
+    if (compactCursor > blocks.size()) compactCursor = blocks.size();
+    size_t end = n < blocks.size() - compactCursor ? compactCursor + n
+                                                   : blocks.size();
+    for (; compactCursor < end; ++compactCursor) {
+      // Searches hold pointers to the blocks they've visited, so those stay.
+      Block *blk = blocks[compactCursor];
+      if (blk->relocatable && Arena::evacuating(blk, blk->sizeClass) &&
+          visitor(blk) == nullptr) {
+        relocate(blk);
+        moved.add(blk);
+      }
+    }
+    if (moved.size() > 0) {
+      // A moved block's old cell still has its id, and blocks has the copy.
+      for (size_t i = 0; i < numHandles; ++i) {
+        Block *&blk = handle(i);
+        if (blk != nullptr && blk->relocatable && blocks[blk->id] != blk) {
+          blk = blocks[blk->id];
+        }
+      }
+      for (size_t i = 0; i < moved.size(); ++i) {
+        arena.release((void *)moved[i], moved[i]->sizeClass);
+      }
+      moved.clear();
+    }
+    if (compactCursor < blocks.size()) return true;
+    arena.endEvacuation();
+    compacting = false;
+    return false;
   }
 
-  void step() {
-    switch (mode) {
-      case Mode::initialize:
-        initializeStep();
-        break;
-      case Mode::search:
-        searchStep();
-        break;
-      case Mode::clear:
-        clearStep();
-        break;
-      case Mode::finalize:
-        finalizeStep();
-        break;
-      case Mode::destroy:
-        destroyStep();
-        break;
-    }
+  void reserve(size_t allocs) {
+    // Make room to register the given number of new blocks without growing.
+    blocks.reserve(blocks.size() + allocs);
+#ifdef __BTGC_Compact__
+    visits.reserve(blocks.size() + allocs);
+    lives.reserve(blocks.size() + allocs);
+#endif
   }
 
-  void *alloc(size_t size, void (*dtor)(void *)) {
-    // Garbage collect.
-    if (blocks.size() > 0) {
-      size_t steps = effort * ((2 * (totalLinks / blocks.size())) + 7);
-      for (size_t i = 0; i < steps; ++i) step();
-    }
+  void *alloc(size_t size, DtorRef dtor, bool leaf, bool relocatable) {
+    collect(1);
+    return allocBlock(size, dtor, leaf, relocatable);
+  }
 
-    // Allocate block.
+  void *allocBlock(size_t size, DtorRef dtor, bool leaf, bool relocatable) {
+    // Allocate block, without doing any GC work.
     // ptr -> [Block][User's data]
-    void *ptr = __BTGC_Malloc__(size + sizeof(Block));
-    Block *blk = new (ptr) Block(blocks.size(), dtor);
+    uint8_t sizeClass = Arena::sizeClass(size + sizeof(Block));
+    void *ptr = arena.allocate(size + sizeof(Block), sizeClass);
+    Block *blk =
+        new (ptr) Block(blocks.size(), dtor, sizeClass, leaf, relocatable);
     blocks.add(blk);
+#ifdef __BTGC_Compact__
+    if (visits.size() <= blk->id) {
+      visits.add(0);
+      lives.add(0);
+    }
+#endif
 
     return (void *)(blk + 1);
   }
 
-  BTGC(double e) : totalLinks(0), mode(Mode::initialize), effort(e) {}
+  BTGC(double e, size_t s)
+      : numOld(0),
+        nurseryCursor(0),
+        sweepTurn(0),
+        liveEpoch(1),
+        candidateTop(0),
+        numCandidates(0),
+        seedTurn(0),
+        totalLinks(0),
+        numSearches(s < 1 ? 1 : s > kMaxSearches ? kMaxSearches : s),
+        nextSearch(0),
+        numWeakCells(0),
+        numHandles(0),
+        numScopes(0),
+        effort(e),
+        collectOnAlloc(true),
+        queueFinalize(false),
+        deferFinalize(false),
+        retiredBatch(0),
+        retiredPos(0),
+        retiredFreed(0),
+        targetWaste(0),
+        targetStepsPerAlloc(0),
+        garbageRate(0),
+        searchesSinceAdapt(0),
+        stepCredit(0) {
+    for (size_t i = 0; i < kPromoteCycles; ++i) sweepStarts[i] = 0;
+    for (size_t i = 0; i < kMaxSearches; ++i) {
+      Search &search = searches[i];
+      search.list = i < numSearches ? new Array<Block *>() : nullptr;
+      search.pos = 0;
+      search.blk = nullptr;
+      search.link = nullptr;
+      search.mode = Mode::initialize;
+      search.stamp = (uint32_t)(kMaxSearches + i);
+      search.proof = kNoProof;
+      search.proofEpoch = 0;
+      search.uniform = true;
+      search.sweep = kNoSweep;
+    }
+#ifdef __BTGC_Background__
+    background = nullptr;
+#endif
+    snapshot = nullptr;
+    compacting = false;
+    compactCursor = 0;
+  }
 
   ~BTGC() {
+#ifdef __BTGC_Background__
+    stopBackgroundThread();
+#endif
+    delete snapshot;
+    // Finalize everything before freeing anything, since destructors unlink
+    // from the blocks their Ptrs point to. Blocks from an interrupted
+    // collection are no longer in blocks, but may not have been finalized.
+    for (size_t i = 0; i < numSearches; ++i) {
+      Search &s = searches[i];
+      if (s.mode != Mode::retire) continue;
+      for (size_t j = 0; j < s.pos; ++j) destruct((*s.list)[j]);
+    }
+    for (size_t i = retiredBatch; i < retired.size(); ++i) {
+      Array<Block *> &batch = *retired[i];
+      size_t first = i == retiredBatch ? retiredPos : 0;
+      for (size_t j = first; j < batch.size(); ++j) destruct(batch[j]);
+    }
     for (size_t i = 0; i < blocks.size(); ++i) {
-      blocks[i]->finalize();
+      destruct(blocks[i]);
+    }
+
+    for (size_t i = 0; i < numSearches; ++i) {
+      Search &s = searches[i];
+      Array<Block *> &list = *s.list;
+      if (s.mode == Mode::finalize || s.mode == Mode::retire) {
+        for (size_t j = 0; j < s.pos; ++j) del(list[j]);
+      } else if (s.mode == Mode::destroy) {
+        for (size_t j = s.pos; j < list.size(); ++j) del(list[j]);
+      }
+      delete s.list;
+    }
+    for (size_t i = retiredBatch; i < retired.size(); ++i) {
+      Array<Block *> &batch = *retired[i];
+      size_t first = i == retiredBatch ? retiredFreed : 0;
+      for (size_t j = first; j < batch.size(); ++j) del(batch[j]);
+      delete &batch;
     }
+    for (size_t i = 0; i < spareLists.size(); ++i) delete spareLists[i];
+    for (size_t i = 0; i < handleChunks.size(); ++i) delete[] handleChunks[i];
     for (size_t i = 0; i < blocks.size(); ++i) {
       del(blocks[i]);
     }
@@ -271,38 +1913,292 @@ class BTGC {
  public:
   template <class T>
   friend class Ptr;
+  template <class T>
+  friend class WeakPtr;
+  template <class T>
+  friend class Local;
+  friend class HandleScope;
 
-  static void init(double effort = 1) { inst = new BTGC(effort); }
-  static void finish() { delete inst; }
+  // Creates and destroys the calling thread's GC. The GC runs the given number
+  // of independent searches at once, up to kMaxSearches, which can collect
+  // more garbage per step on large heaps.
+  static void init(double effort = 1, size_t searches = 1) {
+    inst = new BTGC(effort, searches);
+  }
+  static void finish() {
+    delete inst;
+    inst = nullptr;
+  }
+
+  // Hands the calling thread's GC over to another thread. detach() leaves the
+  // calling thread without a GC, and the returned GC must not be touched, by
+  // any thread, until it has been passed to attach() on its new thread. This
+  // is the only way to move objects between threads: a Ptr must only ever be
+  // used on the thread that owns the GC of the object it points to. Returns
+  // false, and does nothing, if the calling thread already has a GC.
+  static BTGC *detach() {
+    BTGC *gc = inst;
+    inst = nullptr;
+    return gc;
+  }
+  static bool attach(BTGC *gc) {
+    if (inst != nullptr) return false;
+    inst = gc;
+    return true;
+  }
 
   static size_t getNumBlocks() { return inst->blocks.size(); }
   static double getEffort() { return inst->effort; }
   static void setEffort(double e) { inst->effort = e; }
+
+  // Whether each allocation does an amount of GC work proportional to effort.
+  // Disable this to only collect garbage when collectSteps or collectFor are
+  // called, for example in idle time at the end of each frame.
+  static bool getCollectOnAlloc() { return inst->collectOnAlloc; }
+  static void setCollectOnAlloc(bool c) { inst->collectOnAlloc = c; }
+
+  // Adjusts effort automatically, to hold the waste (garbage as a percentage
+  // of live objects) near the target. Pass 0 to go back to a fixed effort.
+  static double getTargetWaste() { return inst->targetWaste; }
+  static void setTargetWaste(double percent) { inst->targetWaste = percent; }
+
+  // Adjusts effort automatically, so that each allocation does roughly this
+  // many steps of GC work, regardless of the shape of the heap. Pass 0 to go
+  // back to a fixed effort. Takes priority over setTargetWaste.
+  static double getTargetStepsPerAlloc() { return inst->targetStepsPerAlloc; }
+  static void setTargetStepsPerAlloc(double steps) {
+    inst->targetStepsPerAlloc = steps;
+  }
+
+  // Bytes of empty arena pages kept for reuse. Beyond these, empty pages are
+  // returned to the OS a few at a time as garbage is freed, and all at once by
+  // collectAll.
+  static size_t getRetainedBytes() {
+    return inst->arena.getRetainedPages() * Arena::kPageSize;
+  }
+  static void setRetainedBytes(size_t bytes) {
+    inst->arena.setRetainedPages(bytes / Arena::kPageSize);
+  }
+
+  // The waste, as a percentage, estimated from recent searches.
+  static double getEstimatedWaste() { return inst->estimatedWaste(); }
+
+  static Stats stats() {
+    Stats stats;
+#ifdef __BTGC_Stats__
+    stats = inst->counters;
+#endif
+    stats.numBlocks = inst->blocks.size();
+    stats.numYoung = inst->blocks.size() - inst->numOld;
+    stats.totalLinks = inst->totalLinks;
+    stats.arenaBytes = inst->arena.residentBytes();
+    return stats;
+  }
+  static void resetStats() {
+#ifdef __BTGC_Stats__
+    inst->counters = Stats();
+#endif
+  }
+
+  // Whether the destructors of garbage are queued, rather than run by GC work,
+  // so that expensive destructors run on the application's own schedule, with
+  // finalizeSteps or finalizeFor. Queued garbage isn't freed until then, and
+  // searches that reach it can't conclude.
+  static bool getQueueFinalize() { return inst->queueFinalize; }
+  static void setQueueFinalize(bool q) {
+    inst->queueFinalize = q;
+#ifdef __BTGC_Background__
+    if (inst->background != nullptr) return;
+#endif
+    inst->deferFinalize = q;
+  }
+
+  // Runs up to n queued destructors, or frees a run of finalized blocks for
+  // each of them. Returns false if the queue is empty.
+  static bool finalizeSteps(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      if (!inst->hasRetired()) return false;
+      inst->drainStep();
+    }
+    return inst->hasRetired();
+  }
+
+  // Runs queued destructors until the budget has been used up, and returns the
+  // number of steps that were run. Destructors can be expensive, so the clock
+  // is checked after each one.
+  static size_t finalizeFor(std::chrono::nanoseconds budget) {
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    size_t steps = 0;
+    while (inst->hasRetired()) {
+      inst->drainStep();
+      ++steps;
+      if (std::chrono::steady_clock::now() >= deadline) break;
+    }
+    return steps;
+  }
+
+  // Blocks until all garbage has been collected, by marking everything that is
+  // reachable from roots, and sweeping the rest. Far faster than running steps
+  // until there's no garbage left, so it suits pauses such as level loads.
+  // Returns the number of objects collected. With queued finalization, the
+  // garbage is queued as usual.
+  static size_t collectAll() { return inst->collectAllGarbage(); }
+
+  // Explicitly runs n steps of GC work.
+  static void collectSteps(size_t n) {
+    inst->runSteps(n);
+  }
+
+  // Explicitly runs GC work until the budget has been used up, and returns the
+  // number of steps that were run. Returns early if there's nothing to collect,
+  // or a snapshot is being written.
+  static size_t collectFor(std::chrono::nanoseconds budget) {
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    size_t steps = 0;
+    while (inst->snapshot == nullptr &&
+           (inst->blocks.size() > 0 || inst->busy())) {
+      collectSteps(kStepsPerClockCheck);
+      steps += kStepsPerClockCheck;
+      if (std::chrono::steady_clock::now() >= deadline) break;
+    }
+    return steps;
+  }
+
+  // Starts writing a snapshot of the heap, which BTGCSnapshot.cc analyses, to
+  // sink. It's sent in chunks, so it takes little memory however big the heap
+  // is, and snapshotSteps spreads the work out, for example over frames. GC
+  // work is suspended until it's finished, but Ptrs can still change, so
+  // backlinks are as they were when their block was written. Does nothing if
+  // a snapshot is already being written.
+  static void beginSnapshot(SnapshotSink sink, void *context = nullptr) {
+    if (inst->snapshot != nullptr) return;
+    Snapshot *snap = new Snapshot;
+    snap->sink = sink;
+    snap->context = context;
+    snap->pos = 0;
+    snap->used = 0;
+    for (size_t i = 0; i < sizeof(kSnapshotMagic) - 1; ++i) {
+      snap->chunk[snap->used++] = (uint8_t)kSnapshotMagic[i];
+    }
+    inst->snapshot = snap;
+  }
+
+  // Moves relocatable objects off pages that are at most half full, into
+  // denser ones, so that the emptied pages can be reused for other sizes, or
+  // returned to the OS. Ptrs, WeakPtrs and Locals follow the objects, but raw
+  // pointers and references to them are left dangling. Objects that searches
+  // are visiting are left where they are.
+  static void compact() {
+    inst->compactStep((size_t)-1);
+    inst->releasePages((size_t)-1);
+  }
+
+  // Looks at up to n more objects of a compaction, starting one if none is in
+  // progress, and returns whether there are more. Until it's finished, nothing
+  // is allocated from the pages it's emptying.
+  static bool compactSteps(size_t n) {
+    bool more = inst->compactStep(n);
+    inst->releasePages(kReleaseBatch);
+    return more;
+  }
+
+  // Writes about n more blocks and backlinks of the snapshot, and returns
+  // whether there's more to write.
+  static bool snapshotSteps(size_t n) {
+    return inst->snapshot != nullptr && inst->snapshotStep(n);
+  }
+
+  // Writes a whole snapshot of the heap at once.
+  static void writeSnapshot(SnapshotSink sink, void *context = nullptr) {
+    beginSnapshot(sink, context);
+    while (snapshotSteps((size_t)-1)) {
+    }
+  }
+
+#ifdef __BTGC_Background__
+  // Starts a collector thread for the calling thread's GC. Between beginIdle()
+  // and endIdle() the collector searches for garbage, while the owning thread
+  // promises not to touch any Ptr or allocate. Found garbage is queued, and
+  // finalized by the owning thread's normal GC work, so destructors still run
+  // on the thread that owns the objects.
+  static void startBackground() {
+    if (inst->background != nullptr) return;
+    inst->background = new Background();
+    inst->deferFinalize = true;
+    inst->background->thread = std::thread(&BTGC::backgroundLoop, inst);
+  }
+
+  static void stopBackground() { inst->stopBackgroundThread(); }
+
+  static void beginIdle() {
+    Background *bg = inst->background;
+    if (bg == nullptr) return;
+    {
+      std::lock_guard<std::mutex> lock(bg->mutex);
+      bg->idle = true;
+    }
+    bg->wake.notify_one();
+  }
+
+  // Blocks until the collector has finished its current step.
+  static void endIdle() {
+    Background *bg = inst->background;
+    if (bg == nullptr) return;
+    bg->yield = true;
+    std::lock_guard<std::mutex> lock(bg->mutex);
+    bg->idle = false;
+    bg->yield = false;
+  }
+#endif
 };
 
 template <class T>
 class Ptr {
+  template <class U>
+  friend class PtrArray;
+  template <class U>
+  friend class WeakPtr;
+  template <class U>
+  friend class Local;
+
   BTGC::Link link;
   static void dtor(void *p) { ((T *)p)->~T(); }
+  static BTGC::DtorRef dtorRef() {
+    if (std::is_trivially_destructible<T>::value) return BTGC::kTrivialDtor;
+    static const BTGC::DtorRef ref = BTGC::registerDtor(dtor);
+    return ref;
+  }
 
  public:
   Ptr() : link(nullptr) {}
   Ptr(const Ptr &ptr) : link(nullptr, ptr.link.to) {}
+  Ptr(Ptr &&ptr) : link(std::move(ptr.link)) {}
   template <class P>
   explicit Ptr(P *from) : link(((BTGC::Block *)from) - 1) {}
   template <class P>
   Ptr(P *from, T *to) : link(((BTGC::Block *)from) - 1, to) {}
+  Ptr(const Local<T> &local) : link(nullptr, local.block()) {}
 
   Ptr &operator=(const Ptr &ptr) {
     link.link(ptr.link.to);
     return *this;
   }
 
+  Ptr &operator=(Ptr &&ptr) {
+    link = std::move(ptr.link);
+    return *this;
+  }
+
   Ptr &operator=(T *ptr) {
     link.link(ptr ? ((BTGC::Block *)ptr) - 1 : nullptr);
     return *this;
   }
 
+  Ptr &operator=(const Local<T> &local) {
+    link.link(local.block());
+    return *this;
+  }
+
   T *operator*() { return (T *)link.ptr(); }
   const T *operator*() const { return (const T *)link.ptr(); }
   T *operator->() { return (T *)link.ptr(); }
@@ -313,14 +2209,339 @@ class Ptr {
   bool operator!=(const Ptr<T> &p) const { return link.to != p.link.to; }
 
   template <typename... Args>
-  static Ptr make(Args... args) {
+  static Ptr make(Args &&...args) {
+    // Link the block before constructing T, so that it's rooted if T's
+    // constructor allocates, and T is constructed directly in the block.
+    Ptr ptr;
+    void *p = BTGC::inst->alloc(sizeof(T), dtorRef(), leaf<T>::value,
+                                relocatable<T>::value);
+    ptr.link.link(((BTGC::Block *)p) - 1);
+    new (p) T(std::forward<Args>(args)...);
+    return ptr;
+  }
+
+  // Appends n new Ts to out, each constructed from args. The GC work for all n
+  // allocations is done up front, and blocks and out are grown just once.
+  template <typename... Args>
+  static void makeN(Array<Ptr> &out, size_t n, const Args &...args) {
+    BTGC::inst->collect(n);
+    BTGC::inst->reserve(n);
+    out.reserve(out.size() + n);
+    for (size_t i = 0; i < n; ++i) {
+      out.add(Ptr());
+      void *p = BTGC::inst->allocBlock(sizeof(T), dtorRef(), leaf<T>::value,
+                                       relocatable<T>::value);
+      out[out.size() - 1].link.link(((BTGC::Block *)p) - 1);
+      new (p) T(args...);
+    }
+  }
+
+  // Points this Ptr at a new T, constructed from args. The args may refer to
+  // this Ptr, so the new block is held by a temporary root until it has been
+  // constructed. Moving that root into this Ptr is O(1) if this is a root.
+  template <typename... Args>
+  Ptr &emplace(Args &&...args) {
+    return *this = make(std::forward<Args>(args)...);
+  }
+};
+
+// A GC managed array of n Ts, in a single block. The elements are stored
+// contiguously after the array's size, and are destroyed when the array is
+// collected. Elements that are Ptrs are non-roots, owned by the array. Other
+// elements must not contain Ptrs, since they have no way of knowing the block
+// they're in.
+template <class T>
+class Ptr<T[]> {
+  BTGC::Link link;
+
+  static size_t &count(void *p) { return *(size_t *)p; }
+  static T *elements(void *p) { return (T *)((size_t *)p + 1); }
+  static void dtor(void *p) {
+    for (size_t i = count(p); i > 0; --i) elements(p)[i - 1].~T();
+  }
+  static BTGC::DtorRef dtorRef() {
+    if (std::is_trivially_destructible<T>::value) return BTGC::kTrivialDtor;
+    static const BTGC::DtorRef ref = BTGC::registerDtor(dtor);
+    return ref;
+  }
+
+  // Elements are roots or leaves, and elements that are Ptrs are owned by the
+  // array. Any other non-root Ptr would take the array as its own block.
+  template <class U>
+  struct isPtr : std::false_type {};
+  template <class U>
+  struct isPtr<Ptr<U>> : std::true_type {};
+
+  // Chosen on isPtr<T>, since for T = Ptr<U> an overload on Ptr<U> * would
+  // lose to the one on T *.
+  template <typename... Args>
+  static void construct(std::false_type, void *, T *p, const Args &...args) {
+    new (p) T(args...);
+  }
+  template <typename... Args>
+  static void construct(std::true_type, void *owner, T *p,
+                        const Args &...args) {
+    new (p) T(owner, args...);
+  }
+
+ public:
+  Ptr() : link(nullptr) {}
+  Ptr(const Ptr &ptr) : link(nullptr, ptr.link.to) {}
+  Ptr(Ptr &&ptr) : link(std::move(ptr.link)) {}
+  template <class P>
+  explicit Ptr(P *from) : link(((BTGC::Block *)from) - 1) {}
+
+  Ptr &operator=(const Ptr &ptr) {
+    link.link(ptr.link.to);
+    return *this;
+  }
+
+  Ptr &operator=(Ptr &&ptr) {
+    link = std::move(ptr.link);
+    return *this;
+  }
+
+  Ptr &operator=(std::nullptr_t ptr) {
+    link.link(nullptr);
+    return *this;
+  }
+
+  size_t size() const { return link.to ? count(link.ptr()) : 0; }
+  T *data() { return elements(link.ptr()); }
+  const T *data() const { return elements(link.ptr()); }
+  T &operator[](size_t i) { return data()[i]; }
+  const T &operator[](size_t i) const { return data()[i]; }
+  T *begin() { return link.to ? data() : nullptr; }
+  T *end() { return link.to ? data() + size() : nullptr; }
+  bool operator==(std::nullptr_t p) const { return link.to == nullptr; }
+  bool operator!=(std::nullptr_t p) const { return link.to != nullptr; }
+  bool operator==(const Ptr &p) const { return link.to == p.link.to; }
+  bool operator!=(const Ptr &p) const { return link.to != p.link.to; }
+
+  // Allocates an array of n Ts, each constructed from args.
+  template <typename... Args>
+  static Ptr make(size_t n, const Args &...args) {
+    static_assert(leaf<T>::value || isPtr<T>::value,
+                  "Ptr<T[]> elements must be btgc::leaf types or Ptrs");
     Ptr ptr;
-    ptr = new (BTGC::inst->alloc(sizeof(T), dtor)) T(args...);
+    void *p = BTGC::inst->alloc(sizeof(size_t) + n * sizeof(T), dtorRef(),
+                                leaf<T>::value, relocatable<T>::value);
+    ptr.link.link(((BTGC::Block *)p) - 1);
+    count(p) = n;
+    for (size_t i = 0; i < n; ++i) {
+      construct(isPtr<T>(), p, elements(p) + i, args...);
+    }
+    return ptr;
+  }
+};
+
+// A growable array of non-root Ptrs, for use inside a managed object, which
+// must be passed to the constructor, just like a non-root Ptr. Unlike an
+// Array<Ptr<T>>, whose elements are roots, this keeps its targets alive only
+// while the enclosing object is reachable. Growing moves each link by patching
+// its neighbours in its target's backlinks, without unlinking and relinking.
+template <class T>
+class PtrArray {
+  void *owner;
+  Ptr<T> *a;
+  size_t n, m;
+
+  void grow(size_t capacity) {
+    m = capacity;
+    Ptr<T> *b = (Ptr<T> *)__BTGC_Malloc__(m * sizeof(Ptr<T>));
+    for (size_t i = 0; i < n; ++i) {
+      new (b + i) Ptr<T>(owner);
+      b[i].link.replace(a[i].link);
+      a[i].~Ptr();
+    }
+    __BTGC_Free__(a);
+    a = b;
+  }
+
+ public:
+  template <class P>
+  explicit PtrArray(P *from, size_t initialCapacity = 4)
+      : owner(from),
+        a((Ptr<T> *)__BTGC_Malloc__(initialCapacity * sizeof(Ptr<T>))),
+        n(0),
+        m(initialCapacity) {}
+  ~PtrArray() {
+    clear();
+    __BTGC_Free__(a);
+  }
+  PtrArray(const PtrArray<T> &box) = delete;
+  PtrArray<T> &operator=(const PtrArray<T> &box) = delete;
+  Ptr<T> &operator[](size_t i) { return a[i]; }
+  const Ptr<T> &operator[](size_t i) const { return a[i]; }
+  size_t size() const { return n; }
+  Ptr<T> *begin() { return a; }
+  Ptr<T> *end() { return a + n; }
+  void del(size_t i) {
+    --n;
+    a[i] = std::move(a[n]);
+    a[n].~Ptr();
+  }
+  Ptr<T> pop() {
+    --n;
+    Ptr<T> t = a[n];
+    a[n].~Ptr();
+    return t;
+  }
+  void clear() { truncate(0); }
+  void truncate(size_t size) {
+    while (n > size) {
+      --n;
+      a[n].~Ptr();
+    }
+  }
+  void reserve(size_t capacity) {
+    if (capacity > m) grow(capacity);
+  }
+  void add(const Ptr<T> &t) {
+    // t may be one of the elements, so its target is read before growing.
+    auto *to = t.link.to;
+    if (n >= m) grow(m > 0 ? m << 1 : 1);
+    new (a + n) Ptr<T>(owner);
+    a[n].link.link(to);
+    ++n;
+  }
+};
+
+// A reference that doesn't keep its target alive, and isn't seen by searches,
+// so it costs nothing to collect the target. Once the target has been found to
+// be garbage, the WeakPtr is expired, and lock() returns a null Ptr. WeakPtrs
+// aren't roots, so they need no enclosing object, but like Ptrs they must be
+// destroyed before BTGC::finish().
+template <class T>
+class WeakPtr {
+  BTGC::WeakCell *cell;
+
+ public:
+  WeakPtr() : cell(nullptr) {}
+  WeakPtr(const Ptr<T> &ptr) : cell(BTGC::inst->weakRef(ptr.link.to)) {}
+  WeakPtr(const WeakPtr &weak) : cell(weak.cell) {
+    if (cell) ++cell->refs;
+  }
+  WeakPtr(WeakPtr &&weak) : cell(weak.cell) { weak.cell = nullptr; }
+  ~WeakPtr() { reset(); }
+
+  WeakPtr &operator=(const WeakPtr &weak) {
+    if (weak.cell) ++weak.cell->refs;
+    reset();
+    cell = weak.cell;
+    return *this;
+  }
+
+  WeakPtr &operator=(WeakPtr &&weak) {
+    if (this == &weak) return *this;
+    reset();
+    cell = weak.cell;
+    weak.cell = nullptr;
+    return *this;
+  }
+
+  WeakPtr &operator=(const Ptr<T> &ptr) {
+    BTGC::WeakCell *c = BTGC::inst->weakRef(ptr.link.to);
+    reset();
+    cell = c;
+    return *this;
+  }
+
+  void reset() {
+    if (cell) BTGC::inst->weakUnref(cell);
+    cell = nullptr;
+  }
+
+  bool expired() const {
+    return cell == nullptr || cell->target == nullptr ||
+           BTGC::inst->dying(cell->target);
+  }
+
+  // Returns a root Ptr to the target, or a null Ptr if it has expired.
+  Ptr<T> lock() const {
+    Ptr<T> ptr;
+    if (!expired()) ptr.link.link(cell->target);
     return ptr;
   }
 };
 
-BTGC *BTGC::inst = nullptr;
+// Locals made while a HandleScope exists are released when it's destroyed.
+// Scopes nest, and must be destroyed in the reverse order they were made, like
+// any local variables. Every Local must be made inside one.
+class HandleScope {
+  size_t base;
+
+ public:
+  HandleScope() : base(BTGC::inst->numHandles) { ++BTGC::inst->numScopes; }
+  ~HandleScope() {
+    BTGC::inst->numHandles = base;
+    --BTGC::inst->numScopes;
+  }
+  HandleScope(const HandleScope &scope) = delete;
+  HandleScope &operator=(const HandleScope &scope) = delete;
+};
+
+// A cheap root for temporary references, such as the cursor of a loop. Rather
+// than linking into its target's backlinks, and poking it, a Local just takes
+// a slot in the GC's handles, and changing it is a single store. The slot
+// belongs to the innermost HandleScope, which is only released with the
+// scope, so a Local must be made inside a scope, which is asserted, and must
+// not outlive it. Nor can it be stored in a GC managed object. Locals aren't
+// written to heap snapshots. Convert to a Ptr to keep a reference for longer.
+template <class T>
+class Local {
+  template <class U>
+  friend class Ptr;
+
+  BTGC::Block **slot;
+
+  BTGC::Block *&block() const { return *slot; }
+
+ public:
+  Local() : slot(BTGC::inst->addHandle(nullptr)) {}
+  Local(const Local &local) : slot(BTGC::inst->addHandle(local.block())) {}
+  Local(const Ptr<T> &ptr) : slot(BTGC::inst->addHandle(ptr.link.to)) {}
+
+  Local &operator=(const Local &local) {
+    block() = local.block();
+    return *this;
+  }
+
+  Local &operator=(const Ptr<T> &ptr) {
+    block() = ptr.link.to;
+    return *this;
+  }
+
+  Local &operator=(std::nullptr_t p) {
+    block() = nullptr;
+    return *this;
+  }
+
+  T *operator*() const { return get(); }
+  T *operator->() const { return get(); }
+  T *get() const {
+    // Unlike a Ptr, there's no need to poke, since searches check the handles
+    // when they conclude anyway.
+    return (T *)block()->ptr();
+  }
+  bool operator==(std::nullptr_t p) const { return block() == nullptr; }
+  bool operator!=(std::nullptr_t p) const { return block() != nullptr; }
+  bool operator==(const Local<T> &l) const { return block() == l.block(); }
+  bool operator!=(const Local<T> &l) const { return block() != l.block(); }
+
+  // Makes a new T, held only by the returned Local.
+  template <typename... Args>
+  static Local make(Args &&...args) {
+    Local local;
+    void *p = BTGC::inst->alloc(sizeof(T), Ptr<T>::dtorRef(), leaf<T>::value,
+                                relocatable<T>::value);
+    local.block() = ((BTGC::Block *)p) - 1;
+    new (p) T(std::forward<Args>(args)...);
+    return local;
+  }
+};
+
+thread_local BTGC *BTGC::inst = nullptr;
 
 BTGC::Link::Link() {
   ++BTGC::inst->totalLinks;
@@ -339,7 +2560,7 @@ BTGC::Link::Link(const Link &blocklink) {
   if (to) {
     BTGC::inst->poke(to);
     next = to->next;
-    prev = (Link *)to;
+    prev = to;
     prev->next = this;
     next->prev = this;
   } else {
@@ -348,6 +2569,20 @@ BTGC::Link::Link(const Link &blocklink) {
   }
 }
 
+BTGC::Link::Link(Link &&blocklink) {
+  ++BTGC::inst->totalLinks;
+  from = nullptr;
+  to = nullptr;
+  next = nullptr;
+  prev = nullptr;
+  if (blocklink.from == nullptr) {
+    replace(blocklink);
+  } else {
+    link(blocklink.to);
+    blocklink.link(nullptr);
+  }
+}
+
 BTGC::Link::Link(Block *_from, Block *_to) {
   ++BTGC::inst->totalLinks;
   from = _from;
@@ -358,12 +2593,12 @@ BTGC::Link::Link(Block *_from, Block *_to) {
     BTGC::inst->poke(to);
     if (from) {
       // Insert at the back.
-      next = (Link *)to;
+      next = to;
       prev = to->prev;
     } else {
       // Insert at the front.
       next = to->next;
-      prev = (Link *)to;
+      prev = to;
     }
     prev->next = this;
     next->prev = this;
@@ -386,6 +2621,7 @@ BTGC::Link::~Link() {
   // Delete this link from to's list of backlinks.
   if (to) {
     BTGC::inst->poke(to);
+    BTGC::inst->unlinked(to, next == prev);
     next->prev = prev;
     prev->next = next;
   }
@@ -395,6 +2631,7 @@ void BTGC::Link::link(Block *_to) {
   // Delete this link from to's list of backlinks.
   if (to) {
     BTGC::inst->poke(to);
+    BTGC::inst->unlinked(to, next == prev);
     next->prev = prev;
     prev->next = next;
   }
@@ -405,12 +2642,12 @@ void BTGC::Link::link(Block *_to) {
     BTGC::inst->poke(to);
     if (from) {
       // Insert at the back.
-      next = (Link *)to;
+      next = to;
       prev = to->prev;
     } else {
       // Insert at the front.
       next = to->next;
-      prev = (Link *)to;
+      prev = to;
     }
     prev->next = this;
     next->prev = this;
@@ -430,6 +2667,37 @@ BTGC::Link &BTGC::Link::operator=(const Link &blocklink) {
   return *this;
 }
 
+BTGC::Link &BTGC::Link::operator=(Link &&blocklink) {
+  if (this == &blocklink) return *this;
+  if (from == blocklink.from) {
+    link(nullptr);
+    replace(blocklink);
+  } else {
+    link(blocklink.to);
+    blocklink.link(nullptr);
+  }
+  return *this;
+}
+
+void BTGC::Link::replace(Link &blocklink) {
+  // Take over blocklink's position in to's list of backlinks, leaving
+  // blocklink null. This assumes that this link is null, and has the same
+  // from as blocklink, so the roots first order of to's backlinks is kept.
+  // The set of blocks pointing to to is unchanged, so there's no need to poke,
+  // but the search may be part way through to's backlinks.
+  to = blocklink.to;
+  if (to) {
+    BTGC::inst->relocated(&blocklink, this);
+    next = blocklink.next;
+    prev = blocklink.prev;
+    prev->next = this;
+    next->prev = this;
+    blocklink.to = nullptr;
+    blocklink.next = nullptr;
+    blocklink.prev = nullptr;
+  }
+}
+
 }  // namespace btgc
 
 #endif  // __BTGC_H__
@@ -0,0 +1,406 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for the GC. Build with optimizations, for example:
+//   c++ -std=c++11 -O2 BTGCBench.cc -o BTGCBench
+// Run with no arguments for every benchmark, or name the ones to run.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "BTGC.h"
+
+using namespace btgc;
+using Clock = std::chrono::steady_clock;
+
+// Records the time taken by every allocation, and samples the waste (garbage as
+// a percentage of live objects), given the number of live objects the workload
+// knows it has. The waste over time is reported as the average of each of
+// kWastePeriods equal runs of samples.
+class Recorder {
+  static constexpr size_t kWastePeriods = 10;
+
+  std::vector<uint32_t> pauses;
+  std::vector<double> wastes;
+  double wasteSum = 0;
+  double wasteMax = 0;
+
+ public:
+  template <class T, typename... Args>
+  Ptr<T> make(Args &&...args) {
+    auto start = Clock::now();
+    Ptr<T> ptr = Ptr<T>::make(std::forward<Args>(args)...);
+    pauses.push_back((uint32_t)std::chrono::duration_cast<
+                         std::chrono::nanoseconds>(Clock::now() - start)
+                         .count());
+    return ptr;
+  }
+
+  void sampleWaste(size_t live) {
+    if (live == 0) return;
+    double waste = (BTGC::getNumBlocks() - (double)live) * 100 / live;
+    wastes.push_back(waste);
+    wasteSum += waste;
+    wasteMax = std::max(wasteMax, waste);
+  }
+
+  void report(const char *name, double seconds) {
+    std::sort(pauses.begin(), pauses.end());
+    auto percentile = [this](double p) {
+      return pauses.empty() ? 0 : pauses[(size_t)(p * (pauses.size() - 1))];
+    };
+    std::printf(
+        "%-12s %9zu allocs %7.0f ms | pause ns p50 %5u p99 %6u p99.9 %7u "
+        "max %8u | waste avg %6.1f%% max %6.1f%%\n",
+        name, pauses.size(), seconds * 1000, percentile(0.5),
+        percentile(0.99), percentile(0.999), percentile(1),
+        wastes.empty() ? 0 : wasteSum / wastes.size(), wasteMax);
+    if (wastes.size() < kWastePeriods) return;
+    std::printf("%-12s waste over time:", "");
+    for (size_t i = 0; i < kWastePeriods; ++i) {
+      size_t begin = i * wastes.size() / kWastePeriods;
+      size_t end = (i + 1) * wastes.size() / kWastePeriods;
+      double sum = 0;
+      for (size_t j = begin; j < end; ++j) sum += wastes[j];
+      std::printf(" %.1f%%", sum / (end - begin));
+    }
+    std::printf("\n");
+  }
+};
+
+constexpr int kSampleInterval = 1000;
+
+struct Node {
+  Ptr<Node> left, right;
+  Node() : left(this), right(this) {}
+};
+
+Ptr<Node> makeTree(Recorder &r, int depth) {
+  Ptr<Node> n = r.make<Node>();
+  if (depth > 1) {
+    n->left = makeTree(r, depth - 1);
+    n->right = makeTree(r, depth - 1);
+  }
+  return n;
+}
+
+// Replaces random complete binary trees.
+void benchTrees(Recorder &r) {
+  constexpr int kTrees = 64;
+  constexpr int kDepth = 10;
+  constexpr size_t kTreeSize = (1 << kDepth) - 1;
+  std::minstd_rand0 generator(1);
+  Array<Ptr<Node>> trees;
+  for (int i = 0; i < kTrees; ++i) trees.add(makeTree(r, kDepth));
+  for (int i = 0; i < 1000; ++i) {
+    trees[generator() % kTrees] = makeTree(r, kDepth);
+    r.sampleWaste(kTrees * kTreeSize);
+  }
+}
+
+// Replaces random layered DAGs, where each node shares its children with its
+// neighbours.
+void benchDags(Recorder &r) {
+  constexpr int kDags = 64;
+  constexpr int kLayers = 32;
+  constexpr int kWidth = 32;
+  std::minstd_rand0 generator(1);
+  auto makeDag = [&] {
+    Array<Ptr<Node>> below, layer;
+    for (int i = 0; i < kWidth; ++i) below.add(r.make<Node>());
+    for (int l = 1; l < kLayers; ++l) {
+      for (int i = 0; i < kWidth; ++i) {
+        Ptr<Node> n = r.make<Node>();
+        n->left = below[i];
+        n->right = below[(i + 1) % kWidth];
+        layer.add(n);
+      }
+      for (int i = 0; i < kWidth; ++i) {
+        below[i] = layer[i];
+        layer[i] = nullptr;
+      }
+      layer.clear();
+    }
+    // Join the top layer under a single root.
+    Ptr<Node> root = below[0];
+    for (int i = 1; i < kWidth; ++i) {
+      Ptr<Node> n = r.make<Node>();
+      n->left = root;
+      n->right = below[i];
+      root = n;
+    }
+    for (int i = 0; i < kWidth; ++i) below[i] = nullptr;
+    return root;
+  };
+  constexpr size_t kDagSize = kLayers * kWidth + kWidth - 1;
+  Array<Ptr<Node>> dags;
+  for (int i = 0; i < kDags; ++i) dags.add(makeDag());
+  for (int i = 0; i < 1000; ++i) {
+    dags[generator() % kDags] = makeDag();
+    r.sampleWaste(kDags * kDagSize);
+  }
+}
+
+// Replaces random rings, with chords across them, so all the garbage is
+// cyclic.
+void benchCycles(Recorder &r) {
+  constexpr int kRings = 64;
+  constexpr int kRingSize = 256;
+  std::minstd_rand0 generator(1);
+  auto makeRing = [&] {
+    Array<Ptr<Node>> nodes;
+    for (int i = 0; i < kRingSize; ++i) nodes.add(r.make<Node>());
+    for (int i = 0; i < kRingSize; ++i) {
+      nodes[i]->left = nodes[(i + 1) % kRingSize];
+      nodes[i]->right = nodes[generator() % kRingSize];
+    }
+    Ptr<Node> ring = nodes[0];
+    for (int i = 0; i < kRingSize; ++i) nodes[i] = nullptr;
+    return ring;
+  };
+  Array<Ptr<Node>> rings;
+  for (int i = 0; i < kRings; ++i) rings.add(makeRing());
+  for (int i = 0; i < 4000; ++i) {
+    rings[generator() % kRings] = makeRing();
+    r.sampleWaste(kRings * kRingSize);
+  }
+}
+
+struct Hub {
+  PtrArray<Node> children;
+  Hub() : children(this) {}
+};
+
+// Replaces random nodes with a very large number of children.
+void benchFanout(Recorder &r) {
+  constexpr int kHubs = 16;
+  constexpr int kChildren = 4096;
+  std::minstd_rand0 generator(1);
+  auto makeHub = [&] {
+    Ptr<Hub> hub = r.make<Hub>();
+    for (int i = 0; i < kChildren; ++i) hub->children.add(r.make<Node>());
+    return hub;
+  };
+  Array<Ptr<Hub>> hubs;
+  for (int i = 0; i < kHubs; ++i) hubs.add(makeHub());
+  for (int i = 0; i < 250; ++i) {
+    hubs[generator() % kHubs] = makeHub();
+    r.sampleWaste(kHubs * (kChildren + 1));
+  }
+}
+
+// Lots of objects sharing one object, which isn't itself a root, so searches
+// that reach it, from the object it shares, face a huge number of backlinks.
+// Each replacement also makes a little cyclic garbage.
+void benchHub(Recorder &r) {
+  constexpr int kReferrers = 100000;
+  std::minstd_rand0 generator(1);
+  Ptr<Node> hub = r.make<Node>();
+  hub->left = r.make<Node>();
+  Array<Ptr<Node>> referrers;
+  for (int i = 0; i < kReferrers; ++i) {
+    referrers.add(r.make<Node>());
+    referrers[i]->left = hub;
+  }
+  hub = nullptr;
+  for (int i = 0; i < 1000000; ++i) {
+    Ptr<Node> n = r.make<Node>();
+    n->left = referrers[0]->left;
+    referrers[generator() % kReferrers] = n;
+    Ptr<Node> c = r.make<Node>();
+    c->left = c;
+    if (i % kSampleInterval == 0) r.sampleWaste(kReferrers + 2);
+  }
+}
+
+// A large tree that stays alive, while lots of short lived garbage is made.
+void benchLiveHeavy(Recorder &r) {
+  constexpr int kDepth = 17;
+  constexpr size_t kTreeSize = (1 << kDepth) - 1;
+  Ptr<Node> tree = makeTree(r, kDepth);
+  for (int i = 0; i < 1000000; ++i) {
+    Ptr<Node> t = r.make<Node>();
+    t->left = t;
+    if (i % kSampleInterval == 0) r.sampleWaste(kTreeSize);
+  }
+}
+
+// Bursts of objects that are all kept, and then all dropped at once.
+void benchBursts(Recorder &r) {
+  constexpr int kBursts = 20;
+  constexpr int kBurstSize = 50000;
+  constexpr int kBase = 10000;
+  Array<Ptr<Node>> base, burst;
+  for (int i = 0; i < kBase; ++i) base.add(r.make<Node>());
+  for (int b = 0; b < kBursts; ++b) {
+    for (int i = 0; i < kBurstSize; ++i) {
+      burst.add(r.make<Node>());
+      if (i % kSampleInterval == 0) r.sampleWaste(kBase + burst.size());
+    }
+    for (size_t i = 0; i < burst.size(); ++i) burst[i] = nullptr;
+    burst.clear();
+    // Allocate through the dropped burst, without keeping anything.
+    for (int i = 0; i < kBurstSize; ++i) {
+      r.make<Node>();
+      if (i % kSampleInterval == 0) r.sampleWaste(kBase);
+    }
+  }
+}
+
+// Pointer writes, compared to raw pointers and std::shared_ptr.
+struct RawNode {
+  RawNode *next = nullptr;
+};
+
+struct SharedNode {
+  std::shared_ptr<SharedNode> next;
+};
+
+template <class Write>
+double nsPerWrite(size_t writes, Write write) {
+  auto start = Clock::now();
+  write();
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  Clock::now() - start)
+                  .count();
+  return ns / writes;
+}
+
+void benchPointerWrites() {
+  constexpr size_t kNodes = 1024;
+  constexpr size_t kWrites = 20000000;
+  std::vector<uint32_t> targets(kWrites);
+  std::minstd_rand0 generator(1);
+  for (size_t i = 0; i < kWrites; ++i) targets[i] = generator() % kNodes;
+
+  std::vector<RawNode> raw(kNodes);
+  double rawNs = nsPerWrite(kWrites, [&] {
+    for (size_t i = 0; i < kWrites; ++i) {
+      raw[i % kNodes].next = &raw[targets[i]];
+    }
+  });
+  // Stop the compiler from dropping the raw writes.
+  volatile RawNode *sink = raw[0].next;
+  (void)sink;
+
+  std::vector<std::shared_ptr<SharedNode>> shared;
+  for (size_t i = 0; i < kNodes; ++i) {
+    shared.push_back(std::make_shared<SharedNode>());
+  }
+  double sharedNs = nsPerWrite(kWrites, [&] {
+    for (size_t i = 0; i < kWrites; ++i) {
+      shared[i % kNodes]->next = shared[targets[i]];
+    }
+  });
+  for (size_t i = 0; i < kNodes; ++i) shared[i]->next = nullptr;
+
+  BTGC::init();
+  {
+    Array<Ptr<Node>> nodes;
+    for (size_t i = 0; i < kNodes; ++i) nodes.add(Ptr<Node>::make());
+    double gcNs = nsPerWrite(kWrites, [&] {
+      for (size_t i = 0; i < kWrites; ++i) {
+        nodes[i % kNodes]->left = nodes[targets[i]];
+      }
+    });
+    std::printf(
+        "%-12s ns per write: raw %.2f, shared_ptr %.2f, Ptr %.2f "
+        "(%.1fx raw, %.2fx shared_ptr)\n",
+        "writes", rawNs, sharedNs, gcNs, gcNs / rawNs, gcNs / sharedNs);
+  }
+  BTGC::finish();
+}
+
+// Walking a list with a temporary reference to each node, held by a root Ptr,
+// or by a Local.
+void benchLocals() {
+  constexpr int kNodes = 1024;
+  constexpr size_t kWalks = 20000;
+  BTGC::init();
+  {
+    Ptr<Node> head = Ptr<Node>::make();
+    for (int i = 1; i < kNodes; ++i) {
+      Ptr<Node> n = Ptr<Node>::make();
+      n->left = head;
+      head = n;
+    }
+    size_t hops = 0;
+    double ptrNs = nsPerWrite(kWalks * kNodes, [&] {
+      for (size_t i = 0; i < kWalks; ++i) {
+        for (Ptr<Node> cur = head; cur != nullptr; cur = cur->left) ++hops;
+      }
+    });
+    double localNs = nsPerWrite(kWalks * kNodes, [&] {
+      for (size_t i = 0; i < kWalks; ++i) {
+        HandleScope scope;
+        for (Local<Node> cur = head; cur != nullptr; cur = cur->left) ++hops;
+      }
+    });
+    std::printf("%-12s ns per hop: Ptr %.2f, Local %.2f (%zu hops)\n",
+                "locals", ptrNs, localNs, hops);
+  }
+  BTGC::finish();
+}
+
+size_t peakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (size_t)usage.ru_maxrss;
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)(Recorder &r);
+};
+
+int main(int argc, char **argv) {
+  const Benchmark benchmarks[] = {
+      {"trees", benchTrees},       {"dags", benchDags},
+      {"cycles", benchCycles},     {"fanout", benchFanout},
+      {"hub", benchHub},           {"live-heavy", benchLiveHeavy},
+      {"bursts", benchBursts},
+  };
+  auto selected = [&](const char *name) {
+    if (argc < 2) return true;
+    for (int i = 1; i < argc; ++i) {
+      if (std::strcmp(argv[i], name) == 0) return true;
+    }
+    return false;
+  };
+
+  for (const Benchmark &b : benchmarks) {
+    if (!selected(b.name)) continue;
+    BTGC::init();
+    {
+      Recorder r;
+      auto start = Clock::now();
+      b.run(r);
+      std::chrono::duration<double> seconds = Clock::now() - start;
+      r.report(b.name, seconds.count());
+    }
+    BTGC::finish();
+  }
+  if (selected("writes")) benchPointerWrites();
+  if (selected("locals")) benchLocals();
+  // Peak RSS only ever goes up, so this is the peak of the biggest benchmark.
+  std::printf("peak RSS %zu KB\n", peakRssKb());
+  return 0;
+}
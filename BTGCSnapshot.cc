@@ -0,0 +1,312 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Analyses a heap snapshot written by BTGC::writeSnapshot. Build with, for
+// example:
+//   c++ -std=c++11 -O2 BTGCSnapshot.cc -o BTGCSnapshot
+// and run with the snapshot's file name. Reports the garbage that searches
+// haven't found yet, grouped by type and by connected sub-graph, and the roots
+// that retain the most memory.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "BTGC.h"
+
+using namespace btgc;
+
+constexpr size_t kTop = 10;
+
+// Reads varints from a file, a buffer at a time.
+class Reader {
+  FILE *file;
+  unsigned char buffer[1 << 16];
+  size_t pos = 0, end = 0;
+
+ public:
+  explicit Reader(FILE *f) : file(f) {}
+
+  bool byte(unsigned char &b) {
+    if (pos == end) {
+      end = std::fread(buffer, 1, sizeof(buffer), file);
+      pos = 0;
+      if (end == 0) return false;
+    }
+    b = buffer[pos++];
+    return true;
+  }
+
+  bool varint(uint64_t &value) {
+    value = 0;
+    unsigned char b;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (!byte(b)) return false;
+      value |= (uint64_t)(b & 0x7f) << shift;
+      if (b < 0x80) return true;
+    }
+    return false;
+  }
+};
+
+// The blocks of a snapshot, and their backlinks, by id.
+struct Heap {
+  std::vector<uint64_t> size, tag;
+  std::vector<uint32_t> roots;    // Number of root backlinks.
+  std::vector<bool> heldByQueue;  // Whether queued garbage points to it.
+  std::vector<size_t> linkStart;  // Backlinks of i are from[linkStart[i]...].
+  std::vector<size_t> from;
+
+  size_t numBlocks() const { return size.size(); }
+};
+
+bool read(FILE *file, Heap &heap) {
+  Reader reader(file);
+  char magic[sizeof(kSnapshotMagic) - 1];
+  for (size_t i = 0; i < sizeof(magic); ++i) {
+    unsigned char b;
+    if (!reader.byte(b)) return false;
+    magic[i] = (char)b;
+  }
+  if (std::memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0) return false;
+  uint64_t id;
+  while (reader.varint(id)) {
+    uint64_t size, tag, flags, code;
+    if (id != heap.numBlocks() || !reader.varint(size) || !reader.varint(tag) ||
+        !reader.varint(flags)) {
+      return false;
+    }
+    heap.size.push_back(size);
+    heap.tag.push_back(tag);
+    heap.roots.push_back(0);
+    heap.heldByQueue.push_back(false);
+    heap.linkStart.push_back(heap.from.size());
+    for (;;) {
+      if (!reader.varint(code)) return false;
+      if (code == kSnapshotEnd) break;
+      if (code == kSnapshotRoot) {
+        ++heap.roots.back();
+      } else if (code == kSnapshotRetired) {
+        heap.heldByQueue.back() = true;
+      } else {
+        heap.from.push_back(code - kSnapshotFirstId);
+      }
+    }
+  }
+  heap.linkStart.push_back(heap.from.size());
+  return true;
+}
+
+// The children of each block, inverted from the backlinks.
+struct Edges {
+  std::vector<size_t> start, to;
+
+  explicit Edges(const Heap &heap)
+      : start(heap.numBlocks() + 1), to(heap.from.size()) {
+    for (size_t from : heap.from) ++start[from + 1];
+    for (size_t i = 0; i < heap.numBlocks(); ++i) start[i + 1] += start[i];
+    std::vector<size_t> pos(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < heap.numBlocks(); ++i) {
+      for (size_t j = heap.linkStart[i]; j < heap.linkStart[i + 1]; ++j) {
+        to[pos[heap.from[j]]++] = i;
+      }
+    }
+  }
+};
+
+// Marks everything reachable from the blocks already on the stack.
+void mark(const Edges &edges, std::vector<size_t> &stack,
+          std::vector<bool> &marked) {
+  while (!stack.empty()) {
+    size_t i = stack.back();
+    stack.pop_back();
+    for (size_t j = edges.start[i]; j < edges.start[i + 1]; ++j) {
+      size_t child = edges.to[j];
+      if (!marked[child]) {
+        marked[child] = true;
+        stack.push_back(child);
+      }
+    }
+  }
+}
+
+struct Total {
+  uint64_t blocks = 0, bytes = 0;
+  void add(uint64_t size) {
+    ++blocks;
+    bytes += size;
+  }
+};
+
+void printTop(const char *title, std::vector<std::pair<Total, uint64_t>> rows,
+              const char *key) {
+  std::sort(rows.begin(), rows.end(), [](const std::pair<Total, uint64_t> &a,
+                                         const std::pair<Total, uint64_t> &b) {
+    return a.first.bytes > b.first.bytes;
+  });
+  std::printf("%s\n", title);
+  for (size_t i = 0; i < rows.size() && i < kTop; ++i) {
+    std::printf("  %12llu bytes %10llu blocks  %s %#llx\n",
+                (unsigned long long)rows[i].first.bytes,
+                (unsigned long long)rows[i].first.blocks, key,
+                (unsigned long long)rows[i].second);
+  }
+}
+
+// Garbage is everything that roots can't reach. What queued garbage points to
+// is freed when the queue is drained, so the rest is what searches missed. It
+// is broken down by type, and into connected sub-graphs, since a search has to
+// visit the whole of one, without it changing, to collect it.
+void reportGarbage(const Heap &heap, const Edges &edges) {
+  size_t n = heap.numBlocks();
+  std::vector<bool> live(n), queued(n);
+  std::vector<size_t> stack;
+  for (size_t i = 0; i < n; ++i) {
+    if (heap.roots[i] > 0) {
+      live[i] = true;
+      stack.push_back(i);
+    }
+  }
+  mark(edges, stack, live);
+  for (size_t i = 0; i < n; ++i) {
+    if (!live[i] && heap.heldByQueue[i]) {
+      queued[i] = true;
+      stack.push_back(i);
+    }
+  }
+  mark(edges, stack, queued);
+
+  // Union the missed garbage into sub-graphs, ignoring edge direction.
+  std::vector<size_t> parent(n);
+  for (size_t i = 0; i < n; ++i) parent[i] = i;
+  auto find = [&parent](size_t i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  Total liveTotal, queuedTotal, missedTotal;
+  std::map<uint64_t, Total> byType;
+  for (size_t i = 0; i < n; ++i) {
+    if (live[i]) {
+      liveTotal.add(heap.size[i]);
+    } else if (queued[i]) {
+      queuedTotal.add(heap.size[i]);
+    } else {
+      missedTotal.add(heap.size[i]);
+      byType[heap.tag[i]].add(heap.size[i]);
+      for (size_t j = heap.linkStart[i]; j < heap.linkStart[i + 1]; ++j) {
+        parent[find(heap.from[j])] = find(i);
+      }
+    }
+  }
+  std::map<size_t, Total> bySubgraph;
+  for (size_t i = 0; i < n; ++i) {
+    if (!live[i] && !queued[i]) bySubgraph[find(i)].add(heap.size[i]);
+  }
+
+  std::printf("Live:          %12llu bytes %10llu blocks\n",
+              (unsigned long long)liveTotal.bytes,
+              (unsigned long long)liveTotal.blocks);
+  std::printf("Queued:        %12llu bytes %10llu blocks\n",
+              (unsigned long long)queuedTotal.bytes,
+              (unsigned long long)queuedTotal.blocks);
+  std::printf("Missed:        %12llu bytes %10llu blocks in %zu sub-graphs\n",
+              (unsigned long long)missedTotal.bytes,
+              (unsigned long long)missedTotal.blocks, bySubgraph.size());
+  std::vector<std::pair<Total, uint64_t>> rows;
+  for (const auto &type : byType) rows.emplace_back(type.second, type.first);
+  printTop("Missed garbage by type:", rows, "type");
+  rows.clear();
+  for (const auto &g : bySubgraph) rows.emplace_back(g.second, g.first);
+  printTop("Largest missed sub-graphs:", rows, "containing block");
+}
+
+// Memory is retained by a root if only that root reaches it. Each rooted block
+// claims what it reaches first, and what a later one reaches too becomes
+// shared, so every block is claimed, and then shared, at most once.
+void reportRoots(const Heap &heap, const Edges &edges) {
+  constexpr size_t kUnclaimed = (size_t)-1;
+  constexpr size_t kShared = (size_t)-2;
+  size_t n = heap.numBlocks();
+  std::vector<size_t> owner(n, kUnclaimed);
+  std::vector<size_t> stack;
+  for (size_t r = 0; r < n; ++r) {
+    if (heap.roots[r] == 0) continue;
+    auto claim = [&](size_t i) {
+      if (owner[i] == kUnclaimed) {
+        owner[i] = r;
+      } else if (owner[i] != r && owner[i] != kShared) {
+        owner[i] = kShared;
+      } else {
+        return;
+      }
+      stack.push_back(i);
+    };
+    claim(r);
+    while (!stack.empty()) {
+      size_t i = stack.back();
+      stack.pop_back();
+      for (size_t j = edges.start[i]; j < edges.start[i + 1]; ++j) {
+        size_t child = edges.to[j];
+        if (owner[i] == kShared) {
+          if (owner[child] != kShared) {
+            owner[child] = kShared;
+            stack.push_back(child);
+          }
+        } else {
+          claim(child);
+        }
+      }
+    }
+  }
+  std::map<size_t, Total> byRoot;
+  Total shared;
+  for (size_t i = 0; i < n; ++i) {
+    if (owner[i] == kShared) {
+      shared.add(heap.size[i]);
+    } else if (owner[i] != kUnclaimed) {
+      byRoot[owner[i]].add(heap.size[i]);
+    }
+  }
+  std::printf("Rooted blocks: %zu, sharing %llu bytes %llu blocks\n",
+              byRoot.size(), (unsigned long long)shared.bytes,
+              (unsigned long long)shared.blocks);
+  std::vector<std::pair<Total, uint64_t>> rows;
+  for (const auto &root : byRoot) rows.emplace_back(root.second, root.first);
+  printTop("Rooted blocks retaining the most:", rows, "block");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::fprintf(stderr, "Usage: %s SNAPSHOT\n", argv[0]);
+    return 2;
+  }
+  FILE *file = std::fopen(argv[1], "rb");
+  if (file == nullptr) {
+    std::perror(argv[1]);
+    return 1;
+  }
+  Heap heap;
+  bool ok = read(file, heap);
+  std::fclose(file);
+  if (!ok) {
+    std::fprintf(stderr, "%s: Not a complete heap snapshot\n", argv[1]);
+    return 1;
+  }
+  Edges edges(heap);
+  reportGarbage(heap, edges);
+  reportRoots(heap, edges);
+  return 0;
+}
@@ -15,19 +15,23 @@
 #include <cstdlib>
 #include <iostream>
 #include <random>
+#include <string>
+#include <thread>
 
 #define __BTGC_Malloc__ testMalloc
 #define __BTGC_Free__ testFree
+#define __BTGC_Stats__
+#define __BTGC_Background__
 
-int totalObjects = 0;
+int totalAllocations = 0;
 
 void* testMalloc(size_t size) {
-  ++totalObjects;
+  ++totalAllocations;
   return malloc(size);
 }
 
 void testFree(void* ptr) {
-  --totalObjects;
+  --totalAllocations;
   free(ptr);
 }
 
@@ -40,9 +44,9 @@ struct Thing {
   Thing() : next(this) {}  // Initialize non-root Ptr with this.
 };
 
-int main() {
-  BTGC::init();
-
+// Roots must all be destroyed before BTGC::finish(), so each test keeps its
+// Ptrs inside its own scope.
+void testChurn() {
   constexpr int kIterations = 1000000;
   constexpr int kReportInterval = 1000;
   constexpr int kThingLinks = 10;
@@ -70,17 +74,694 @@ int main() {
     }
     if (i % kReportInterval == 0) {
       int reachables = things.size() * kThingLinks;
+      int totalObjects = BTGC::getNumBlocks();
       std::cout << "Iteration: " << i << "\tReachable objects: " << reachables
                 << "\tTotal objects: " << totalObjects << "\tWaste: "
                 << ((totalObjects - reachables) * 100.0 / reachables) << "%"
                 << std::endl;
     }
   }
+}
+
+// Elements of an array of Ptrs are non-roots, owned by the array, so dropping
+// the array makes everything only it points to garbage, even when that
+// includes the array itself.
+struct ArrayThing {
+  Ptr<Ptr<ArrayThing>[]> elements;
+  ArrayThing() : elements(this) {}
+};
+
+bool testArrays() {
+  constexpr int kIterations = 100000;
+  constexpr int kArraySize = 16;
+  constexpr int kCycles = 1000;
+  constexpr size_t kMaxBlocks = 100000;
+
+  BTGC::collectAll();
+  size_t before = BTGC::getNumBlocks();
+  size_t most = 0;
+  {
+    Ptr<Ptr<Thing>[]> kept = Ptr<Ptr<Thing>[]>::make(kArraySize);
+    for (int i = 0; i < kIterations; ++i) {
+      Ptr<Ptr<Thing>[]> things = Ptr<Ptr<Thing>[]>::make(kArraySize);
+      for (Ptr<Thing> &t : things) t = Ptr<Thing>::make();
+      kept[i % kArraySize] = things[i % kArraySize];
+
+      Ptr<int[]> values = Ptr<int[]>::make(kArraySize, i);
+      if (values.size() != kArraySize || values[kArraySize - 1] != i) {
+        std::cerr << "Array has wrong contents" << std::endl;
+        return false;
+      }
+      size_t blocks = BTGC::getNumBlocks();
+      if (blocks > most) most = blocks;
+    }
+    BTGC::collectAll();
+    if (BTGC::getNumBlocks() != before + 1 + kArraySize) {
+      std::cerr << "Unreachable arrays weren't collected" << std::endl;
+      return false;
+    }
+  }
+
+  // Each thing's array points back at the thing, so both are in a cycle.
+  for (int i = 0; i < kCycles; ++i) {
+    Ptr<ArrayThing> t = Ptr<ArrayThing>::make();
+    t->elements = Ptr<Ptr<ArrayThing>[]>::make(2);
+    t->elements[0] = t;
+  }
+  size_t cycles = BTGC::getNumBlocks();
+  BTGC::collectAll();
+  size_t after = BTGC::getNumBlocks();
+  std::cout << "Arrays: Most objects: " << most << "\tIn cycles: " << cycles
+            << "\tAfter collectAll: " << after << std::endl;
+  return most < before + kMaxBlocks && after == before;
+}
+
+struct Node {
+  PtrArray<Node> edges;
+  Node() : edges(this) {}  // Initialize non-root PtrArray with this.
+};
+
+struct EmptyNode {
+  PtrArray<EmptyNode> edges;
+  EmptyNode() : edges(this, 0) {}
+};
+
+// Nodes point to each other through growable arrays of non-root Ptrs, making
+// lots of cycles, which are still collected once they're unreachable.
+bool testPtrArrays() {
+  constexpr int kIterations = 100000;
+  constexpr int kEdges = 8;
+  constexpr int kGraphSize = 100;
+  constexpr size_t kMaxBlocks = 100 * kGraphSize;
+
+  std::minstd_rand0 generator(time(nullptr));
+  std::uniform_int_distribution<int> randNode(0, kGraphSize - 1);
+
+  BTGC::collectAll();
+  size_t before = BTGC::getNumBlocks();
+  size_t most = 0;
+  {
+    Array<Ptr<Node>> graph;
+    for (int i = 0; i < kGraphSize; ++i) graph.add(Ptr<Node>::make());
+    for (int i = 0; i < kIterations; ++i) {
+      // Replace a random node with a new one, which links to random nodes, and
+      // is linked to from random nodes.
+      Ptr<Node> n = Ptr<Node>::make();
+      for (int j = 0; j < kEdges; ++j) {
+        n->edges.add(graph[randNode(generator)]);
+        graph[randNode(generator)]->edges.add(n);
+      }
+      Ptr<Node> &replaced = graph[randNode(generator)];
+      replaced->edges.clear();
+      replaced = n;
+      size_t blocks = BTGC::getNumBlocks();
+      if (blocks > most) most = blocks;
+      if (i % (kIterations / 10) == 0) {
+        std::cout << "Graph: Total objects: " << blocks << std::endl;
+      }
+    }
+  }
+  BTGC::collectAll();
+  size_t after = BTGC::getNumBlocks();
+
+  // An array made with no initial capacity still grows on its first add.
+  Ptr<EmptyNode> single = Ptr<EmptyNode>::make();
+  single->edges.add(single);
+  bool grew = single->edges.size() == 1 && single->edges[0] == single;
+
+  std::cout << "Graph: Most objects: " << most
+            << "\tAfter collectAll: " << after << std::endl;
+  return most < before + kMaxBlocks && after == before && grew;
+}
+
+// Adding an array's own element still works when the add grows the array.
+bool testPtrArraySelfAdd() {
+  constexpr int kEdges = 100;
+
+  Ptr<Node> n = Ptr<Node>::make();
+  n->edges.add(n);
+  for (int i = 1; i < kEdges; ++i) n->edges.add(n->edges[0]);
+  bool ok = n->edges.size() == kEdges;
+  for (Ptr<Node> &e : n->edges) ok = ok && e == n;
+  return ok;
+}
+
+// Weak references keep nothing alive, and expire once their target has been
+// found to be garbage, but never while it's reachable.
+bool testWeakPtrs() {
+  constexpr int kIterations = 100000;
+  constexpr int kCacheSize = 100;
+  constexpr int kKept = 10;
+
+  Array<Ptr<Thing>> kept;
+  Array<WeakPtr<Thing>> cache;
+  for (int i = 0; i < kCacheSize; ++i) cache.add(WeakPtr<Thing>());
+  for (int i = 0; i < kIterations; ++i) {
+    Ptr<Thing> t = Ptr<Thing>::make();
+    cache[i % kCacheSize] = t;
+    if (i % (kIterations / kKept) == 0) kept.add(t);
+  }
+  for (size_t i = 0; i < kept.size(); ++i) {
+    WeakPtr<Thing> weak = kept[i];
+    if (weak.expired() || weak.lock() != kept[i]) {
+      std::cerr << "Weak reference to a live object expired" << std::endl;
+      return false;
+    }
+  }
+  // None of the cached things were kept, so they all expire once collected.
+  BTGC::collectSteps(100 * kCacheSize);
+  int expired = 0;
+  for (size_t i = 0; i < cache.size(); ++i) {
+    if (cache[i].expired() && cache[i].lock() == nullptr) ++expired;
+  }
+  BTGC::collectAll();
+  int collected = 0;
+  for (size_t i = 0; i < cache.size(); ++i) {
+    if (cache[i].expired() && cache[i].lock() == nullptr) ++collected;
+  }
+  for (size_t i = 0; i < kept.size(); ++i) {
+    if (WeakPtr<Thing>(kept[i]).expired()) {
+      std::cerr << "Weak reference to a live object expired" << std::endl;
+      return false;
+    }
+  }
+  std::cout << "Weak: Total objects: " << BTGC::getNumBlocks()
+            << "\tExpired: " << expired
+            << "\tAfter collectAll: " << collected << std::endl;
+  return expired > 0 && collected == kCacheSize;
+}
+
+int destroyed = 0;
+
+struct Counted {
+  ~Counted() { ++destroyed; }
+};
+
+// With queued finalization, garbage is found by GC work, but its destructors
+// only run when the queue is drained.
+bool testQueueFinalize() {
+  constexpr int kIterations = 10000;
+
+  BTGC::setQueueFinalize(true);
+  destroyed = 0;
+  for (int i = 0; i < kIterations; ++i) Ptr<Counted>::make();
+  BTGC::collectSteps(10 * kIterations);
+  if (destroyed != 0) {
+    std::cerr << "Queued destructor ran early" << std::endl;
+    return false;
+  }
+  BTGC::finalizeFor(std::chrono::milliseconds(100));
+  while (BTGC::finalizeSteps(100)) {
+  }
+  int found = destroyed;
+  BTGC::setQueueFinalize(false);
+  std::cout << "Queue: Destroyed: " << found
+            << "\tTotal objects: " << BTGC::getNumBlocks() << std::endl;
+  return found > 0;
+}
+
+struct Tagged {
+  int tag;
+  explicit Tagged(int t) : tag(t) {}
+  ~Tagged() { ++destroyed; }
+};
+
+// makeN builds n objects from the same arguments, in n new blocks, which are
+// collected like any others once they're dropped.
+bool testMakeN() {
+  constexpr int kObjects = 1000;
+  constexpr int kTag = 7;
+
+  BTGC::collectAll();
+  BTGC::setCollectOnAlloc(false);
+  destroyed = 0;
+  size_t before = BTGC::getNumBlocks();
+  Array<Ptr<Tagged>> made;
+  Ptr<Tagged>::makeN(made, kObjects, kTag);
+  size_t after = BTGC::getNumBlocks();
+  bool ok = made.size() == kObjects && after == before + kObjects;
+  for (size_t i = 0; i < made.size(); ++i) {
+    if (made[i]->tag != kTag || (i > 0 && made[i] == made[i - 1])) ok = false;
+  }
+  for (size_t i = 0; i < made.size(); ++i) made[i] = nullptr;
+  BTGC::collectAll();
+  BTGC::setCollectOnAlloc(true);
+  std::cout << "MakeN: Made: " << after - before << "\tDestroyed: " << destroyed
+            << std::endl;
+  return ok && destroyed == kObjects && BTGC::getNumBlocks() == before;
+}
+
+// collectAll reclaims all garbage, including cycles, and nothing else.
+bool testCollectAll() {
+  constexpr int kRings = 1000;
+  constexpr int kRingSize = 10;
+
+  BTGC::collectAll();
+  BTGC::setCollectOnAlloc(false);
+  Array<Ptr<Thing>> kept;
+  for (int i = 0; i < kRings; ++i) {
+    Ptr<Thing> head = Ptr<Thing>::make();
+    Ptr<Thing> t = head;
+    for (int j = 1; j < kRingSize; ++j) {
+      t->next = Ptr<Thing>::make();
+      t = t->next;
+    }
+    t->next = head;
+    if (i % 2 == 0) kept.add(head);
+  }
+  size_t collected = BTGC::collectAll();
+  BTGC::setCollectOnAlloc(true);
+  std::cout << "CollectAll: Collected: " << collected
+            << "\tTotal objects: " << BTGC::getNumBlocks() << std::endl;
+  return collected == kRings / 2 * kRingSize &&
+         BTGC::getNumBlocks() == kRings / 2 * kRingSize;
+}
+
+// A GC, and the objects in it, can be handed to another thread, which then
+// collects and finishes it, but only a thread without a GC can take one.
+bool testDetach() {
+  constexpr int kLists = 100;
+  constexpr int kListLength = 10;
+
+  BTGC *own = BTGC::detach();
+  BTGC::init();
+  Array<Ptr<Thing>> *lists = new Array<Ptr<Thing>>();
+  for (int i = 0; i < kLists; ++i) {
+    Ptr<Thing> head;
+    for (int j = 0; j < kListLength; ++j) {
+      Ptr<Thing> t = Ptr<Thing>::make();
+      t->next = head;
+      head = t;
+    }
+    lists->add(head);
+  }
+  BTGC *gc = BTGC::detach();
+  bool refused = false;
+  int length = 0;
+  size_t left = 1;
+  std::thread thread([&]() {
+    BTGC::attach(gc);
+    refused = !BTGC::attach(own);
+    for (Ptr<Thing> t = (*lists)[0]; t != nullptr; t = t->next) ++length;
+    for (int i = 0; i < kLists; ++i) (*lists)[i] = nullptr;
+    delete lists;
+    BTGC::collectAll();
+    left = BTGC::getNumBlocks();
+    BTGC::finish();
+  });
+  thread.join();
+  bool attached = BTGC::attach(own);
+  std::cout << "Detach: Length: " << length << "\tLeft: " << left << std::endl;
+  return attached && refused && length == kListLength && left == 0;
+}
+
+struct ListNode {
+  Ptr<ListNode> next, prev;
+  ListNode() : next(this), prev(this) {}
+};
+
+// With several searches in flight, garbage too big for one search to cover
+// in one go, such as doubly linked lists, is collected by searches merging as
+// they run into each other. Searches seeded in a long live chain spend a while
+// in it, and dereferencing the chain between steps pokes them, which mustn't
+// stop the searches collecting the garbage.
+bool testSearches() {
+  constexpr size_t kSearches = 8;
+  constexpr int kLists = 20;
+  constexpr int kListLength = 1000;
+  constexpr int kChain = 2000;
+  constexpr int kMaxRounds = 100000;
+
+  BTGC *own = BTGC::detach();
+  BTGC::init(1, kSearches);
+  BTGC::setCollectOnAlloc(false);
+  size_t left;
+  int rounds = 0;
+  Stats stats;
+  {
+    Array<Ptr<ListNode>> lists;
+    for (int i = 0; i < kLists; ++i) {
+      Ptr<ListNode> head = Ptr<ListNode>::make(), t = head;
+      for (int j = 1; j < kListLength; ++j) {
+        Ptr<ListNode> n = Ptr<ListNode>::make();
+        t->next = n;
+        n->prev = t;
+        t = n;
+      }
+      lists.add(head);
+    }
+    Ptr<Thing> chain = Ptr<Thing>::make();
+    for (int i = 1; i < kChain; ++i) {
+      Ptr<Thing> t = Ptr<Thing>::make();
+      t->next = chain;
+      chain = t;
+    }
+    for (int i = 0; i < kLists; ++i) lists[i] = nullptr;
+    while (BTGC::getNumBlocks() > kChain && rounds < kMaxRounds) {
+      BTGC::collectSteps(64);
+      for (Ptr<Thing> *t = &chain; *t != nullptr; t = &(*t)->next) {
+      }
+      ++rounds;
+    }
+    left = BTGC::getNumBlocks();
+    stats = BTGC::stats();
+  }
+  BTGC::finish();
+  BTGC::attach(own);
+  std::cout << "Searches: Rounds: " << rounds << "\tLeft: " << left
+            << "\tMerged: " << stats.searchesMerged
+            << "\tPoked: " << stats.searchesPoked << std::endl;
+  return left == kChain && stats.searchesMerged > 0 && stats.searchesPoked > 0;
+}
+
+// A search's stamps wrap around every 2^19 searches, without a full rescan of
+// the heap. Live blocks marked by older stamps mustn't look visited when the
+// stamps come round again, so nothing live is collected.
+bool testRestamp() {
+  constexpr int kKept = 1000;
+  constexpr size_t kSearches = 3 << 18;
+
+  BTGC *own = BTGC::detach();
+  BTGC::init();
+  BTGC::setCollectOnAlloc(false);
+  size_t left;
+  bool intact = true;
+  size_t searches;
+  {
+    Array<Ptr<Thing>> kept;
+    for (int i = 0; i < kKept; ++i) {
+      Ptr<Thing> t = Ptr<Thing>::make();
+      t->next = Ptr<Thing>::make();
+      t->next->next = t;
+      kept.add(t);
+    }
+    while (BTGC::stats().searchesStarted < kSearches) {
+      for (int i = 0; i < 8; ++i) {
+        Ptr<Thing> t = Ptr<Thing>::make();
+        t->next = Ptr<Thing>::make();
+        t->next->next = t;
+      }
+      BTGC::collectSteps(64);
+    }
+    BTGC::collectAll();
+    left = BTGC::getNumBlocks();
+    for (int i = 0; i < kKept; ++i) intact &= kept[i]->next->next == kept[i];
+    searches = BTGC::stats().searchesStarted;
+  }
+  BTGC::finish();
+  BTGC::attach(own);
+  std::cout << "Restamp: Searches: " << searches << "\tLeft: " << left
+            << std::endl;
+  return intact && left == 2 * kKept;
+}
+
+// Empty pages beyond the retained ones go back to the OS, and can be reused.
+bool testReleasePages() {
+  constexpr int kThings = 100000;
+  constexpr size_t kMinReleased = 32 * Arena::kPageSize;
+
+  BTGC::collectAll();
+  size_t retained = BTGC::getRetainedBytes();
+  BTGC::setRetainedBytes(0);
+  Array<Ptr<Thing>> things;
+  for (int i = 0; i < kThings; ++i) things.add(Ptr<Thing>::make());
+  size_t peak = BTGC::stats().arenaBytes;
+  for (int i = 0; i < kThings; ++i) things[i] = nullptr;
+  BTGC::collectSteps(kThings * 4);
+  size_t incremental = BTGC::stats().arenaBytes;
+  BTGC::collectAll();
+  size_t after = BTGC::stats().arenaBytes;
+  for (int i = 0; i < kThings; ++i) things[i] = Ptr<Thing>::make();
+  for (int i = 0; i < kThings; ++i) things[i] = nullptr;
+  BTGC::collectAll();
+  BTGC::setRetainedBytes(retained);
+  std::cout << "ReleasePages: Peak: " << peak
+            << "\tAfter collectSteps: " << incremental
+            << "\tAfter collectAll: " << after << std::endl;
+  return incremental + kMinReleased <= peak && after <= incremental &&
+         BTGC::stats().pagesReleased > 0;
+}
+
+struct Particle {
+  double x, y, z;
+};
+
+namespace btgc {
+template <>
+struct relocatable<Particle> : std::true_type {};
+}  // namespace btgc
+
+// Compaction packs the survivors of sparse pages densely, and everything that
+// refers to them follows them.
+bool testCompact() {
+  constexpr int kParticles = 100000;
+  constexpr int kKeepEvery = 16;
+
+  BTGC::collectAll();
+  size_t retained = BTGC::getRetainedBytes();
+  BTGC::setRetainedBytes(0);
+  Array<Ptr<Particle>> particles;
+  for (int i = 0; i < kParticles; ++i) {
+    particles.add(Ptr<Particle>::make(Particle{(double)i, 0, 0}));
+  }
+  for (int i = 0; i < kParticles; ++i) {
+    if (i % kKeepEvery != 0) particles[i] = nullptr;
+  }
+  Ptr<Particle> &first = particles[0];
+  Ptr<Ptr<Particle>[]> shared = Ptr<Ptr<Particle>[]>::make(2);
+  shared[0] = first;
+  shared[1] = first;
+  WeakPtr<Particle> weak = first;
+  BTGC::collectAll();
+  size_t before = BTGC::stats().arenaBytes;
+  bool ok = true;
+  {
+    HandleScope scope;
+    Local<Particle> local = first;
+    BTGC::compact();
+    while (BTGC::compactSteps(100)) {
+    }
+    ok = local == first && local->x == 0;
+  }
+  size_t after = BTGC::stats().arenaBytes;
+  for (int i = 0; i < kParticles; i += kKeepEvery) {
+    if (particles[i]->x != i) ok = false;
+  }
+  ok = ok && shared[0] == first && shared[1] == first && weak.lock() == first;
+  BTGC::setRetainedBytes(retained);
+  std::cout << "Compact: Before: " << before << "\tAfter: " << after
+            << "\tMoved: " << BTGC::stats().blocksMoved << std::endl;
+  if (!ok) {
+    std::cerr << "Compaction lost track of an object" << std::endl;
+    return false;
+  }
+  return after * 2 <= before;
+}
+
+// A node shared by lots of rooted Things, but not rooted itself, keeps what it
+// points to alive, however searches reach it, while garbage around it is still
+// collected.
+bool testSharedNode() {
+  constexpr int kIterations = 100000;
+  constexpr int kReferrers = 10000;
+
+  std::minstd_rand0 generator(time(nullptr));
+  std::uniform_int_distribution<int> randReferrer(0, kReferrers - 1);
+
+  Ptr<Thing> shared = Ptr<Thing>::make();
+  shared->next = Ptr<Thing>::make();
+  WeakPtr<Thing> child = shared->next;
+  Array<Ptr<Thing>> referrers;
+  for (int i = 0; i < kReferrers; ++i) {
+    referrers.add(Ptr<Thing>::make());
+    referrers[i]->next = shared;
+  }
+  shared = nullptr;
+  for (int i = 0; i < kIterations; ++i) {
+    Ptr<Thing> t = Ptr<Thing>::make();
+    t->next = referrers[0]->next;
+    referrers[randReferrer(generator)] = t;
+    Ptr<Thing> garbage = Ptr<Thing>::make();
+    garbage->next = garbage;
+  }
+  std::cout << "Shared: Total objects: " << BTGC::getNumBlocks() << std::endl;
+  if (child.expired()) {
+    std::cerr << "Child of a shared node was collected" << std::endl;
+    return false;
+  }
+  return BTGC::getNumBlocks() < 2 * (kReferrers + 2);
+}
+
+struct CountedThing {
+  Ptr<CountedThing> next;
+  CountedThing() : next(this) {}
+  ~CountedThing() { ++destroyed; }
+};
+
+// Locals keep what they point to alive, without any backlinks, until their
+// HandleScope is destroyed.
+bool testLocals() {
+  constexpr int kIterations = 100000;
+  constexpr int kChain = 100;
+
+  destroyed = 0;
+  {
+    HandleScope scope;
+    Local<CountedThing> head = Local<CountedThing>::make();
+    Local<CountedThing> cur = head;
+    for (int i = 1; i < kChain; ++i) {
+      cur->next = Local<CountedThing>::make();
+      cur = cur->next;
+    }
+    for (int i = 0; i < kIterations; ++i) {
+      HandleScope inner;
+      Local<Thing> t = Local<Thing>::make();
+      t->next = Ptr<Thing>::make();
+    }
+    int length = 0;
+    for (cur = head; cur != nullptr; cur = cur->next) ++length;
+    if (destroyed != 0 || length != kChain) {
+      std::cerr << "Object held by a Local was collected" << std::endl;
+      return false;
+    }
+  }
+  BTGC::collectAll();
+  std::cout << "Locals: Destroyed: " << destroyed
+            << "\tTotal objects: " << BTGC::getNumBlocks() << std::endl;
+  return destroyed == kChain;
+}
+
+// A background collector finds garbage while the owning thread is idle, which
+// the owning thread then finalizes. Live rings keep it busy, so stopping it
+// while idle has to interrupt it.
+bool testBackground() {
+  constexpr int kRings = 1000;
+  constexpr int kRingSize = 10;
+  constexpr int kMaxIdles = 100;
+
+  BTGC::collectAll();
+  BTGC::setCollectOnAlloc(false);
+  destroyed = 0;
+  Array<Ptr<CountedThing>> kept;
+  for (int i = 0; i < kRings; ++i) {
+    Ptr<CountedThing> head = Ptr<CountedThing>::make();
+    Ptr<CountedThing> t = head;
+    for (int j = 1; j < kRingSize; ++j) {
+      t->next = Ptr<CountedThing>::make();
+      t = t->next;
+    }
+    t->next = head;
+    if (i % 2 == 0) kept.add(head);
+  }
+  BTGC::setCollectOnAlloc(true);
+  BTGC::startBackground();
+  int idles = 0;
+  while (destroyed == 0 && idles < kMaxIdles) {
+    BTGC::beginIdle();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    BTGC::endIdle();
+    BTGC::collectSteps(1);
+    ++idles;
+  }
+  int found = destroyed;
+  BTGC::beginIdle();
+  BTGC::stopBackground();
+  BTGC::collectAll();
+  while (BTGC::finalizeSteps(100)) {
+  }
+  std::cout << "Background: Idles: " << idles << "\tDestroyed: " << found
+            << std::endl;
+  return found > 0 && destroyed == kRings / 2 * kRingSize;
+}
+
+void appendChunk(const void* data, size_t size, void* context) {
+  static_cast<std::string*>(context)->append((const char*)data, size);
+}
+
+// A snapshot written in small steps has a record for every block, including
+// those allocated part way through, with root backlinks where there are roots.
+bool testSnapshot() {
+  constexpr int kKept = 1000;
+
+  Array<Ptr<Thing>> kept;
+  for (int i = 0; i < kKept; ++i) {
+    kept.add(Ptr<Thing>::make());
+    kept[i]->next = Ptr<Thing>::make();
+  }
+  std::string data;
+  BTGC::beginSnapshot(appendChunk, &data);
+  while (BTGC::snapshotSteps(100)) kept.add(Ptr<Thing>::make());
+  size_t pos = sizeof(kSnapshotMagic) - 1;
+  auto varint = [&data, &pos]() {
+    uint64_t value = 0;
+    for (int shift = 0; pos < data.size(); shift += 7) {
+      unsigned char b = data[pos++];
+      value |= (uint64_t)(b & 0x7f) << shift;
+      if (b < 0x80) break;
+    }
+    return value;
+  };
+  size_t records = 0, roots = 0;
+  while (pos < data.size()) {
+    if (varint() != records) return false;
+    for (int i = 0; i < 3; ++i) varint();  // Size, type tag and flags.
+    for (uint64_t code = varint(); code != kSnapshotEnd; code = varint()) {
+      if (code == kSnapshotRoot) ++roots;
+    }
+    ++records;
+  }
+  std::cout << "Snapshot: Bytes: " << data.size() << "\tBlocks: " << records
+            << "\tRoots: " << roots << std::endl;
+  return data.compare(0, sizeof(kSnapshotMagic) - 1, kSnapshotMagic) == 0 &&
+         records == BTGC::getNumBlocks() && roots >= kept.size();
+}
+
+// Every search that was started has ended in exactly one way, or is still in
+// flight, and is counted in the histogram of search lengths once it ends.
+bool testStats() {
+  Stats stats = BTGC::stats();
+  size_t ended = stats.searchesPoked + stats.searchesProvenLive +
+                 stats.searchesBlocked + stats.searchesCompleted;
+  size_t histogram = 0;
+  for (size_t i = 0; i < Stats::kSearchLengthBuckets; ++i) {
+    histogram += stats.searchLengths[i];
+  }
+  std::cout << "Stats: Searches: " << stats.searchesStarted
+            << "\tCompleted: " << stats.searchesCompleted
+            << "\tBlocks freed: " << stats.blocksFreed
+            << "\tMax pause: " << stats.maxAllocPause.count() << "ns"
+            << std::endl;
+  return stats.searchesCompleted > 0 && stats.blocksFreed > 0 &&
+         histogram == ended && stats.numYoung <= stats.numBlocks &&
+         ended + stats.searchesMerged <= stats.searchesStarted;
+}
+
+int main() {
+  BTGC::init();
+
+  testChurn();
+  if (!testArrays()) return 1;
+  if (!testPtrArrays()) return 1;
+  if (!testPtrArraySelfAdd()) return 1;
+  if (!testWeakPtrs()) return 1;
+  if (!testQueueFinalize()) return 1;
+  if (!testMakeN()) return 1;
+  if (!testCollectAll()) return 1;
+  if (!testDetach()) return 1;
+  if (!testSearches()) return 1;
+  if (!testRestamp()) return 1;
+  if (!testReleasePages()) return 1;
+  if (!testCompact()) return 1;
+  if (!testSharedNode()) return 1;
+  if (!testSnapshot()) return 1;
+  if (!testLocals()) return 1;
+  if (!testBackground()) return 1;
+  if (!testStats()) return 1;
 
   BTGC::finish();
 
-  if (totalObjects != 0) {
-    std::cerr << "Cleanup failed. Leaked: " << totalObjects << std::endl;
+  if (totalAllocations != 0) {
+    std::cerr << "Cleanup failed. Leaked: " << totalAllocations << std::endl;
     return 1;
   }
   return 0;